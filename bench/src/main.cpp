@@ -0,0 +1,161 @@
+// kaleidoscope-bench - Microbenchmarks for lexer, parser, and codegen
+// throughput on synthetic workloads. The harness includes the compiler
+// translation unit directly to drive the internal entry points against
+// in-memory buffers, binding its own CompilerState like any other host.
+
+#include "../../kaleidoscope/src/language.cpp"
+
+#include <chrono>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+double SecondsSince(Clock::time_point Start) {
+  return std::chrono::duration<double>(Clock::now() - Start).count();
+}
+
+// BenchLexer - Pump roughly TargetTokens synthetic tokens through gettok()
+// and report tokens/sec.
+void BenchLexer(size_t TargetTokens) {
+  // Eleven tokens per repetition, mixing identifiers, literals, and
+  // operators in roughly the proportions of generated module files.
+  const char *Chunk = "alpha beta12 4.5 + gamma * 2.75 < delta - 9 ";
+  const size_t TokensPerChunk = 11;
+
+  std::string Source;
+
+  Source.reserve(TargetTokens / TokensPerChunk * strlen(Chunk) + 64);
+
+  for (size_t i = 0; i < TargetTokens / TokensPerChunk; ++i)
+    Source += Chunk;
+
+  ResetLexer(Source.data(), Source.data() + Source.size());
+
+  size_t Tokens = 0;
+
+  auto Start = Clock::now();
+
+  while (gettok() != tok_eof)
+    ++Tokens;
+
+  double Elapsed = SecondsSince(Start);
+
+  printf("lexer:   %10zu tokens   %8.2f Mtok/s\n", Tokens,
+         Tokens / Elapsed / 1e6);
+}
+
+// BenchParser - Parse NumExprs expressions of TermsPerExpr terms each and
+// report AST nodes/sec. Wide operator chains exercise the shunting-yard loop;
+// distinct variable terms keep the constant folder out of the measurement.
+void BenchParser(size_t NumExprs, size_t TermsPerExpr) {
+  std::string Source;
+
+  Source.reserve(NumExprs * TermsPerExpr * 6);
+
+  for (size_t i = 0; i < NumExprs; ++i) {
+    for (size_t j = 0; j < TermsPerExpr; ++j) {
+      if (j) {
+        Source += (j % 2) ? '+' : '*';
+      }
+
+      Source += 'v';
+      Source += std::to_string(j % 26);
+    }
+
+    Source += ";\n";
+  }
+
+  ResetLexer(Source.data(), Source.data() + Source.size());
+
+  getNextToken();
+
+  size_t Exprs = 0;
+
+  auto Start = Clock::now();
+
+  while (S->CurTok != tok_eof) {
+    if (S->CurTok == ';') {
+      getNextToken();
+
+      continue;
+    }
+
+    if (ParseExpression())
+      ++Exprs;
+
+    S->astArena.Reset();
+  }
+
+  double Elapsed = SecondsSince(Start);
+
+  // A chain of N terms builds N leaves plus N-1 binary nodes.
+  size_t Nodes = Exprs * (2 * TermsPerExpr - 1);
+
+  printf("parser:  %10zu nodes    %8.2f Mnode/s\n", Nodes,
+         Nodes / Elapsed / 1e6);
+}
+
+// BenchCodegen - Parse NumFunctions small definitions up front, then measure
+// FunctionAST::codegen() alone and report functions/sec.
+void BenchCodegen(size_t NumFunctions) {
+  std::string Source;
+
+  Source.reserve(NumFunctions * 48);
+
+  for (size_t i = 0; i < NumFunctions; ++i)
+    Source += "def bfn" + std::to_string(i) + "(a b c) a*b+c*" +
+              std::to_string(i) + ".0+a-b*c;\n";
+
+  ResetLexer(Source.data(), Source.data() + Source.size());
+
+  getNextToken();
+
+  std::vector<std::unique_ptr<FunctionAST>> Definitions;
+
+  while (S->CurTok != tok_eof) {
+    if (S->CurTok == ';') {
+      getNextToken();
+
+      continue;
+    }
+
+    if (auto FnAST = ParseDefinition())
+      Definitions.push_back(std::move(FnAST));
+  }
+
+  auto Start = Clock::now();
+
+  for (auto &FnAST : Definitions)
+    FnAST->codegen();
+
+  double Elapsed = SecondsSince(Start);
+
+  S->astArena.Reset();
+
+  printf("codegen: %10zu functions %7.2f kfunc/s (-O%d)\n",
+         Definitions.size(), Definitions.size() / Elapsed / 1e3, S->OptLevel);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  CompilerState State;
+
+  BindSession Bind(State);
+
+  for (int i = 1; i < argc; ++i)
+    if (argv[i][0] == '-' && argv[i][1] == 'O' && isdigit(argv[i][2]))
+      S->OptLevel = argv[i][2] - '0';
+
+  if (!InitializeJIT())
+    return 1;
+
+  InitializeModule();
+
+  BenchLexer(10 * 1000 * 1000);
+  BenchParser(2000, 500);
+  BenchCodegen(5000);
+
+  return 0;
+}
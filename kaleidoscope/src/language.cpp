@@ -1 +1,3483 @@
-#include "language.h"
\ No newline at end of file
+// language.cpp - The Kaleidoscope compiler: lexer, parser, AST, codegen, and
+// JIT, with every piece of mutable state gathered into a CompilerState so the
+// whole thing is usable as a library (see language.h). The command-line
+// driver lives in main.cpp; the benchmark harness includes this translation
+// unit directly to reach the internal entry points.
+
+#include "language.h"
+
+#include <llvm/ADT/APFloat.h>
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/IR/BasicBlock.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/DerivedTypes.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/Type.h>
+#include <llvm/IR/Verifier.h>
+
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/ExecutionEngine/ObjectCache.h>
+#include <llvm/ExecutionEngine/Orc/CompileUtils.h>
+#include <llvm/ExecutionEngine/Orc/ExecutionUtils.h>
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/Linker/Linker.h>
+#include <llvm/MC/TargetRegistry.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Host.h>
+#include <llvm/Support/MD5.h>
+#include <llvm/Support/MemoryBufferRef.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/TargetSelect.h>
+#include <llvm/Support/Timer.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Target/TargetMachine.h>
+#include <llvm/Target/TargetOptions.h>
+#include <llvm/Transforms/IPO.h>
+#include <llvm/Transforms/IPO/PassManagerBuilder.h>
+#include <llvm/Transforms/InstCombine/InstCombine.h>
+#include <llvm/Transforms/Scalar.h>
+#include <llvm/Transforms/Scalar/GVN.h>
+#include <llvm/Transforms/Utils.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+//----------------------------------------------------------------------------//
+//                              Compiler state
+//----------------------------------------------------------------------------//
+
+// SymbolTable - Interns identifier spellings into dense integer IDs as they
+// are lexed. The AST stores IDs instead of strings and scope lookup becomes
+// integer indexing; each unique spelling is kept exactly once for IR names
+// and diagnostics.
+class SymbolTable {
+  llvm::StringMap<unsigned> IDs;
+  std::vector<std::string> Spellings;
+
+public:
+  unsigned intern(llvm::StringRef Name) {
+    auto It = IDs.try_emplace(Name, (unsigned)Spellings.size());
+
+    if (It.second)
+      Spellings.push_back(Name.str());
+
+    return It.first->second;
+  }
+
+  const std::string &spelling(unsigned ID) const { return Spellings[ID]; }
+
+  size_t size() const { return Spellings.size(); }
+};
+// LexedToken - A fully lexed token: the kind plus whichever payload it
+// carries.
+struct LexedToken {
+  int Kind;
+  double Num;     // tok_number
+  unsigned Ident; // tok_identifier
+};
+
+// TokenRing - Fixed power-of-two ring the lexer fills in batches ahead of the
+// parser. The parser peeks any of the buffered tokens in O(1) and the
+// per-token gettok() overhead (including its comment-skip re-entry) is paid
+// in bursts instead of once per parser decision. Head and Tail are absolute
+// counts; the ring index is the masked difference.
+static const size_t TokenRingSize = 64;
+
+// CountASTNode - Bumps the session's AST node counter; out of line because
+// ASTArena::make() runs before CompilerState below is complete.
+static void CountASTNode();
+
+// ASTArena - Bump allocator that owns every expression node for a translation
+// unit. Nodes are placement-new'd into megabyte chunks and released wholesale
+// once codegen for the current top-level unit is done, so parsing costs one
+// malloc per chunk instead of one per node and the tree stays contiguous in
+// memory for the codegen walk.
+class ASTArena {
+  static const size_t ChunkSize = 1 << 20;
+
+  std::vector<std::unique_ptr<char[]>> Chunks;
+  size_t Offset = ChunkSize;
+
+  // Nodes whose members own heap memory (names, argument vectors) still need
+  // their destructors; remember how to run them before the chunks go away.
+  std::vector<std::pair<void *, void (*)(void *)>> Destructors;
+
+public:
+  // Nodes never materialize under -lazy sessions that end early, so the
+  // arena runs the deferred destructors itself when the session goes away.
+  ~ASTArena() { Reset(); }
+
+  template <typename T, typename... ArgTs> T *make(ArgTs &&... Args) {
+    size_t Size =
+        (sizeof(T) + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+
+    if (Offset + Size > ChunkSize) {
+      Chunks.push_back(std::unique_ptr<char[]>(new char[ChunkSize]));
+      Offset = 0;
+    }
+
+    void *Mem = Chunks.back().get() + Offset;
+
+    Offset += Size;
+
+    CountASTNode();
+
+    T *Node = new (Mem) T(std::forward<ArgTs>(Args)...);
+
+    if (!std::is_trivially_destructible<T>::value)
+      Destructors.emplace_back(Node, [](void *P) { ((T *)P)->~T(); });
+
+    return Node;
+  }
+
+  void Reset() {
+    for (auto I = Destructors.rbegin(), E = Destructors.rend(); I != E; ++I)
+      I->second(I->first);
+
+    Destructors.clear();
+    Chunks.clear();
+
+    Offset = ChunkSize;
+  }
+};
+
+class NumberExprAST;
+class VariableExprAST;
+class ExprAST;
+class FunctionAST;
+
+// Forward declarations for the incremental-compilation hasher (see
+// HashFunction below), befriended by the node classes that keep their
+// members private.
+static uint64_t HashExpr(const ExprAST *E, uint64_t H,
+                         std::vector<unsigned> &Callees);
+static uint64_t HashFunction(const FunctionAST &Fn,
+                             std::vector<unsigned> &Callees);
+
+// ExprKind - Discriminator for the expression classes below. Dispatch is a
+// switch on this tag instead of a vtable, so nodes carry one byte in place
+// of a vptr and the codegen walk is a branch-predictable switch over nodes
+// sitting contiguously in the arena.
+enum ExprKind : unsigned char {
+  Expr_Number,
+  Expr_Variable,
+  Expr_Binary,
+  Expr_Unary,
+  Expr_Call,
+  Expr_If,
+  Expr_For,
+  Expr_Var
+};
+
+// ExprAst - Base class for all expression nodes. Nodes live in astArena and
+// are referenced by plain pointers; nobody deletes them individually (the
+// arena registers each node's destructor, typed at allocation, so nothing
+// here needs to be virtual).
+class ExprAST {
+  ExprKind Kind;
+
+public:
+  ExprAST(ExprKind Kind) : Kind(Kind) {}
+
+  ExprKind getKind() const { return Kind; }
+
+  llvm::Value *codegen();
+
+  // asNumber - Non-null when this node is a literal, which is what the
+  // constant folder keys on.
+  const NumberExprAST *asNumber() const;
+
+  // asVariable - Non-null when this node is a plain variable reference;
+  // assignment codegen uses it to find its destination.
+  const VariableExprAST *asVariable() const;
+};
+
+// NumberExprAST - Expression class for numbers.
+class NumberExprAST : public ExprAST {
+  double Val;
+
+public:
+  NumberExprAST(double Val) : ExprAST(Expr_Number), Val(Val) {}
+  llvm::Value *codegen();
+
+  double getVal() const { return Val; }
+};
+
+// VariableExprAST - Expression class for variables, identified by interned
+// symbol ID.
+class VariableExprAST : public ExprAST {
+  unsigned Name;
+
+public:
+  VariableExprAST(unsigned Name) : ExprAST(Expr_Variable), Name(Name) {}
+  llvm::Value *codegen();
+
+  unsigned getName() const { return Name; }
+};
+
+inline const NumberExprAST *ExprAST::asNumber() const {
+  return Kind == Expr_Number ? static_cast<const NumberExprAST *>(this)
+                             : nullptr;
+}
+
+inline const VariableExprAST *ExprAST::asVariable() const {
+  return Kind == Expr_Variable ? static_cast<const VariableExprAST *>(this)
+                               : nullptr;
+}
+
+// BinaryExprAST - Expression class for binary operators. FnName is the
+// interned name of the implementing function ("binary|" and the like) for
+// user-defined operators, resolved at parse time so codegen -- which may run
+// on parallel workers -- never writes the symbol table; it is 0 and unused
+// for the built-in operators.
+class BinaryExprAST : public ExprAST {
+  char Op;
+  ExprAST *LHS, *RHS;
+  unsigned FnName;
+
+public:
+  BinaryExprAST(char op, ExprAST *LHS, ExprAST *RHS, unsigned FnName = 0)
+      : ExprAST(Expr_Binary), Op(op), LHS(LHS), RHS(RHS), FnName(FnName) {}
+  llvm::Value *codegen();
+
+  friend uint64_t HashExpr(const ExprAST *, uint64_t, std::vector<unsigned> &);
+};
+
+// UnaryExprAST - Expression class for user-defined unary operators; the
+// opcode is kept for diagnostics, FnName ("unary!" etc.) for the call.
+class UnaryExprAST : public ExprAST {
+  char Opcode;
+  unsigned FnName;
+  ExprAST *Operand;
+
+public:
+  UnaryExprAST(char Opcode, unsigned FnName, ExprAST *Operand)
+      : ExprAST(Expr_Unary), Opcode(Opcode), FnName(FnName),
+        Operand(Operand) {}
+  llvm::Value *codegen();
+
+  friend uint64_t HashExpr(const ExprAST *, uint64_t, std::vector<unsigned> &);
+};
+
+// CallExprAST - Expression class for functions calls. Up to four argument
+// pointers live inline in the node (which covers almost every call), so
+// walking a call does not chase a separate heap allocation.
+class CallExprAST : public ExprAST {
+  unsigned Calle;
+  llvm::SmallVector<ExprAST *, 4> Args;
+
+public:
+  CallExprAST(unsigned Calle, llvm::SmallVector<ExprAST *, 4> Args)
+      : ExprAST(Expr_Call), Calle(Calle), Args(std::move(Args)) {}
+  llvm::Value *codegen();
+
+  friend uint64_t HashExpr(const ExprAST *, uint64_t, std::vector<unsigned> &);
+};
+
+// IfExprAST - Expression class for if/then/else, codegenned as a real
+// two-armed CFG merged by a phi node.
+class IfExprAST : public ExprAST {
+  ExprAST *Cond, *Then, *Else;
+
+public:
+  IfExprAST(ExprAST *Cond, ExprAST *Then, ExprAST *Else)
+      : ExprAST(Expr_If), Cond(Cond), Then(Then), Else(Else) {}
+  llvm::Value *codegen();
+
+  friend uint64_t HashExpr(const ExprAST *, uint64_t, std::vector<unsigned> &);
+};
+
+// ForExprAST - Expression class for 'for i = start, end (, step)? in body'.
+// The induction variable lives in an entry-block alloca like any mutable
+// variable, so the whole loop stays inside JIT'd native code and mem2reg
+// turns it into a register phi.
+class ForExprAST : public ExprAST {
+  unsigned VarName;
+  ExprAST *Start, *End, *Step, *Body;
+
+public:
+  ForExprAST(unsigned VarName, ExprAST *Start, ExprAST *End, ExprAST *Step,
+             ExprAST *Body)
+      : ExprAST(Expr_For), VarName(VarName), Start(Start), End(End),
+        Step(Step), Body(Body) {}
+  llvm::Value *codegen();
+
+  friend uint64_t HashExpr(const ExprAST *, uint64_t, std::vector<unsigned> &);
+};
+
+// VarExprAST - Expression class for 'var a = init, b in body'. Each name gets
+// a stack slot in the function's entry block; mem2reg promotes the slots to
+// SSA registers, so hot loops written with mutable accumulators compile down
+// to register-only code.
+class VarExprAST : public ExprAST {
+  llvm::SmallVector<std::pair<unsigned, ExprAST *>, 4> VarNames;
+  ExprAST *Body;
+
+public:
+  VarExprAST(llvm::SmallVector<std::pair<unsigned, ExprAST *>, 4> VarNames,
+             ExprAST *Body)
+      : ExprAST(Expr_Var), VarNames(std::move(VarNames)), Body(Body) {}
+  llvm::Value *codegen();
+
+  friend uint64_t HashExpr(const ExprAST *, uint64_t, std::vector<unsigned> &);
+};
+
+class PrototypeAST {
+  unsigned Name;
+  std::vector<unsigned> Args;
+
+public:
+  PrototypeAST(unsigned Name, std::vector<unsigned> Args)
+      : Name(Name), Args(std::move(Args)) {}
+
+  const std::string &getName() const;
+
+  unsigned getNameID() const { return Name; }
+
+  const std::vector<unsigned> &getArgs() const { return Args; }
+
+  llvm::Function *codegen();
+};
+
+class FunctionAST {
+  std::unique_ptr<PrototypeAST> Proto;
+  ExprAST *Body;
+
+public:
+  FunctionAST(std::unique_ptr<PrototypeAST> Proto, ExprAST *Body)
+      : Proto(std::move(Proto)), Body(Body) {}
+
+  PrototypeAST &getProto() { return *Proto; }
+
+  llvm::Function *codegen();
+
+  friend uint64_t HashFunction(const FunctionAST &, std::vector<unsigned> &);
+};
+
+// ExprAST::codegen - Devirtualized dispatch: one predictable switch on the
+// node tag in place of an indirect call through a vtable per node.
+inline llvm::Value *ExprAST::codegen() {
+  switch (Kind) {
+  case Expr_Number:
+    return static_cast<NumberExprAST *>(this)->codegen();
+  case Expr_Variable:
+    return static_cast<VariableExprAST *>(this)->codegen();
+  case Expr_Binary:
+    return static_cast<BinaryExprAST *>(this)->codegen();
+  case Expr_Unary:
+    return static_cast<UnaryExprAST *>(this)->codegen();
+  case Expr_Call:
+    return static_cast<CallExprAST *>(this)->codegen();
+  case Expr_If:
+    return static_cast<IfExprAST *>(this)->codegen();
+  case Expr_For:
+    return static_cast<ForExprAST *>(this)->codegen();
+  case Expr_Var:
+    return static_cast<VarExprAST *>(this)->codegen();
+  }
+
+  return nullptr;
+}
+
+// ScopeMap - Values in scope for the function currently being codegenned,
+// indexed directly by interned symbol ID: lookup is one bounds check and one
+// load. Clearing only touches the IDs set since the last clear, so wiping the
+// scope between functions stays O(number of parameters).
+class ScopeMap {
+  std::vector<llvm::Value *> Values;
+  std::vector<unsigned> Live;
+
+public:
+  llvm::Value *lookup(unsigned Sym) const {
+    return Sym < Values.size() ? Values[Sym] : nullptr;
+  }
+
+  void insert(unsigned Sym, llvm::Value *V) {
+    if (Sym >= Values.size())
+      Values.resize(Sym + 1);
+
+    Values[Sym] = V;
+
+    Live.push_back(Sym);
+  }
+
+  void clear() {
+    for (unsigned Sym : Live)
+      Values[Sym] = nullptr;
+
+    Live.clear();
+  }
+};
+
+// FunctionCache - Inline cache for call resolution, indexed by interned
+// symbol ID like ScopeMap. Generated modules contain enormous numbers of
+// calls to a handful of callees; after the first resolution of a callee the
+// StringMap lookup in Module::getFunction() is replaced by one bounds check
+// and one load. The cache is per module (cleared whenever the module is
+// rebuilt) and per thread, so -j workers each cache their own declarations.
+class FunctionCache {
+  std::vector<llvm::Function *> Functions;
+  std::vector<unsigned> Live;
+
+public:
+  llvm::Function *lookup(unsigned Sym) const {
+    return Sym < Functions.size() ? Functions[Sym] : nullptr;
+  }
+
+  void insert(unsigned Sym, llvm::Function *F) {
+    if (Sym >= Functions.size())
+      Functions.resize(Sym + 1);
+
+    Functions[Sym] = F;
+
+    Live.push_back(Sym);
+  }
+
+  // invalidate - Drop one entry; used when a function is erased from the
+  // module after its body failed to codegen.
+  void invalidate(unsigned Sym) {
+    if (Sym < Functions.size())
+      Functions[Sym] = nullptr;
+  }
+
+  void clear() {
+    for (unsigned Sym : Live)
+      Functions[Sym] = nullptr;
+
+    Live.clear();
+  }
+};
+
+// DiskObjectCache - On-disk cache of JIT-compiled objects, keyed by an MD5 of
+// each module's bitcode. Warm runs of an unchanged prelude hit in getObject()
+// and the backend never runs: the cached object is mapped straight off disk.
+// Enabled by -cache-dir <path>; disabled (and free) otherwise.
+class DiskObjectCache : public llvm::ObjectCache {
+  std::string CacheDir;
+
+public:
+  void setCacheDir(std::string Dir) { CacheDir = std::move(Dir); }
+
+  const std::string &cacheDir() const { return CacheDir; }
+
+  bool enabled() const { return !CacheDir.empty(); }
+
+  void notifyObjectCompiled(const llvm::Module *M,
+                            llvm::MemoryBufferRef Obj) override {
+    if (!enabled())
+      return;
+
+    if (llvm::sys::fs::create_directories(CacheDir))
+      return;
+
+    std::error_code EC;
+    llvm::raw_fd_ostream Out(pathFor(M), EC, llvm::sys::fs::OF_None);
+
+    if (EC)
+      return;
+
+    Out << Obj.getBuffer();
+  }
+
+  std::unique_ptr<llvm::MemoryBuffer> getObject(const llvm::Module *M) override {
+    if (!enabled())
+      return nullptr;
+
+    auto Buffer = llvm::MemoryBuffer::getFile(pathFor(M));
+
+    if (!Buffer)
+      return nullptr;
+
+    return std::move(*Buffer);
+  }
+
+private:
+  // pathFor - Cache file name derived from the module contents. Bitcode is a
+  // stable serialization of the IR, so the same definitions hash to the same
+  // entry across runs while any source change misses and recompiles.
+  std::string pathFor(const llvm::Module *M) const {
+    llvm::SmallString<0> Bitcode;
+    llvm::raw_svector_ostream BCStream(Bitcode);
+
+    llvm::WriteBitcodeToFile(*M, BCStream);
+
+    llvm::MD5 Hash;
+    llvm::MD5::MD5Result Result;
+
+    Hash.update(Bitcode);
+    Hash.final(Result);
+
+    llvm::SmallString<128> Path(CacheDir);
+
+    llvm::sys::path::append(Path, "kls-" + Result.digest() + ".o");
+
+    return std::string(Path.str());
+  }
+};
+
+// CodegenState - The LLVM objects FunctionAST::codegen() writes through.
+// Parallel codegen workers (-j<N>) each bind their own copy via the
+// thread_local CG pointer below, so the same codegen path runs on every
+// worker without locking; the serial path uses the session's MainCG.
+struct CodegenState {
+  std::unique_ptr<llvm::LLVMContext> llvmContext;
+  std::unique_ptr<llvm::IRBuilder<>> irBuilder;
+
+  std::unique_ptr<llvm::Module> module;
+
+  // Per-function optimization pipeline, rebuilt alongside the module in
+  // InitializeModule() and run on every function before it reaches the JIT;
+  // OptLevel 0 disables it.
+  std::unique_ptr<llvm::legacy::FunctionPassManager> functionPassManager;
+
+  // namedValues - Values in scope for the function currently being
+  // codegenned.
+  ScopeMap namedValues;
+
+  // functionCache - Inline cache for call resolution in this module.
+  FunctionCache functionCache;
+
+  // moduleDefs - Interned names of the definitions whose bodies live in the
+  // current module; they become jitOwnedFunctions when the module is handed
+  // to the JIT.
+  std::vector<unsigned> moduleDefs;
+};
+
+// CompilerState - One complete compilation session: lexer input and token
+// ring, interned symbols, parser state, the prototype registry, options,
+// counters, and the JIT. Nothing in the compiler lives at file scope anymore,
+// so a host process can hold several sessions and every entry point works
+// against whichever one the thread_local S pointer is aimed at.
+struct CompilerState {
+  // symbolTable - Interns identifier spellings; declared first so the
+  // keyword and builtin IDs below can intern through it.
+  SymbolTable symbolTable;
+
+  // Lexer input. When a source file is given the whole file is mapped (or
+  // read) into one buffer and the lexer scans a raw cursor over it, which
+  // avoids a libc call per character; with no buffer the lexer falls back to
+  // getchar() so the REPL keeps working on stdin.
+  const char *InputCursor = nullptr;
+  const char *InputEnd = nullptr;
+
+  char *MappedInput = nullptr;
+  size_t MappedInputSize = 0;
+  bool InputIsMapped = false;
+
+  // Payload of the token gettok() last produced: the identifier spelling
+  // (the buffer is reused so steady-state lexing does not allocate), its
+  // interned ID, and the numeric value.
+  std::string IdentifierStr;
+  unsigned IdentifierID = 0;
+  double NumVal = 0;
+
+  // LastChar - One-character lexer lookahead.
+  int LastChar = ' ';
+
+  // Ring cursors for the token lookahead buffer; Head and Tail are absolute
+  // counts and the ring index is the masked difference.
+  size_t TokenRingHead = 0, TokenRingTail = 0;
+
+  LexedToken TokenRing[TokenRingSize] = {};
+
+  // astArena - Owns every expression node parsed by the session.
+  ASTArena astArena;
+
+  // CurTok - The token the parser is looking at.
+  int CurTok = 0;
+
+  // BinopPrecedence - Precedence for every ASCII operator character; 0 means
+  // "not a binary operator". A flat array indexed by the token char makes
+  // GetTokPrecedence() a single load on the parser's innermost loop. Defaults
+  // are installed by the constructor; user-defined operators add entries at
+  // parse time.
+  int BinopPrecedence[256] = {};
+
+  // functionProtos - Session-persistent prototype registry; see
+  // RegisterPrototype().
+  std::map<unsigned, PrototypeAST> functionProtos;
+
+  // pendingFunctions - Definitions deferred by -lazy until first use.
+  std::map<unsigned, std::unique_ptr<FunctionAST>> pendingFunctions;
+
+  // symbolVersions - How many times each name has been redefined. Modules
+  // the JIT owns are immutable and its dylib rejects duplicate symbols, so a
+  // redefinition compiles under a ".N" suffixed symbol instead (see
+  // JITSymbolName()); call sites codegenned afterwards bind to the newest
+  // version, ones already compiled keep the one they were built against.
+  std::map<unsigned, unsigned> symbolVersions;
+
+  // jitOwnedFunctions - Names whose current version's body has been handed
+  // to the JIT; defining one of these again must bump its version.
+  std::set<unsigned> jitOwnedFunctions;
+
+  std::unique_ptr<llvm::orc::LLJIT> theJIT;
+
+  DiskObjectCache objectCache;
+
+  // Session options, fixed when the embedding Session is constructed.
+  int OptLevel = 2;
+  bool ShowStats = false;
+  bool EmitIR = false;
+  bool LazyCodegen = false;
+  bool KeepModuleForEmission = false;
+
+  // PrintResults - Echo "Evaluated to" lines for top-level expressions. The
+  // interactive driver turns this on; embedders read LastValue instead.
+  bool PrintResults = false;
+
+  // Value of the most recent top-level expression, if any evaluated yet.
+  double LastValue = 0;
+  bool HaveValue = false;
+
+  // -stats counters. Functions compile on parallel codegen workers under
+  // -j<N>, so that one counter is atomic; relaxed increments cost no more
+  // than plain ones here.
+  uint64_t NumTokensLexed = 0;
+  uint64_t NumASTNodes = 0;
+  std::atomic<uint64_t> NumFunctionsCompiled{0};
+  uint64_t NumModulesJITed = 0;
+
+  // Phase timers, per session so concurrent sessions never contend on (or
+  // pollute) each other's numbers.
+  llvm::TimerGroup statsGroup{"kaleidoscope", "Kaleidoscope compilation phases"};
+
+  llvm::Timer lexTimer{"lex", "Lexing", statsGroup};
+  llvm::Timer parseTimer{"parse", "Parsing", statsGroup};
+  llvm::Timer codegenTimer{"codegen", "IR generation", statsGroup};
+  llvm::Timer jitTimer{"jit", "JIT backend and symbol resolution", statsGroup};
+
+  // 'binary' and 'unary' are contextual keywords in prototypes, matched by
+  // interned ID; the vector builtin names are interned eagerly too, so
+  // parallel codegen workers only ever read the symbol table when matching
+  // call names.
+  const unsigned BinaryKwID = symbolTable.intern("binary");
+  const unsigned UnaryKwID = symbolTable.intern("unary");
+  const unsigned VAddID = symbolTable.intern("vadd");
+  const unsigned VMulID = symbolTable.intern("vmul");
+  const unsigned VFMAID = symbolTable.intern("vfma");
+  const unsigned ReduceAddID = symbolTable.intern("reduce_add");
+
+  // AnonCount - Every evaluation gets a distinct __anon_expr name: once its
+  // module has moved into the JIT the symbol stays defined there, so the
+  // name cannot be reused.
+  unsigned AnonCount = 0;
+
+  // MainCG - Codegen state for the session's own thread; -j workers bring
+  // their own.
+  CodegenState MainCG;
+
+  CompilerState() {
+    BinopPrecedence['='] = 2;
+    BinopPrecedence['<'] = 10;
+    BinopPrecedence['+'] = 20;
+    BinopPrecedence['-'] = 20;
+    BinopPrecedence['*'] = 40;
+  }
+};
+
+// S, CG - The session and codegen state every compiler entry point works
+// against, bound per thread: independent sessions can run on different
+// threads, and -j workers swap in a private CodegenState while sharing the
+// session through S.
+static thread_local CompilerState *S = nullptr;
+static thread_local CodegenState *CG = nullptr;
+
+const std::string &PrototypeAST::getName() const {
+  return S->symbolTable.spelling(Name);
+}
+
+static void CountASTNode() { ++S->NumASTNodes; }
+
+// BindSession - Aim the thread_local state pointers at one session for the
+// duration of a library call, restoring the previous binding on the way out
+// so re-entrant use from a host callback stays correct.
+struct BindSession {
+  CompilerState *PrevS;
+  CodegenState *PrevCG;
+
+  BindSession(CompilerState &State) : PrevS(S), PrevCG(CG) {
+    S = &State;
+    CG = &State.MainCG;
+  }
+
+  ~BindSession() {
+    S = PrevS;
+    CG = PrevCG;
+  }
+};
+
+//----------------------------------------------------------------------------//
+//                               Statistics
+//----------------------------------------------------------------------------//
+
+
+// DumpStats - Print the counters and the timer group (wall, user, and system
+// time per phase) to stderr at exit.
+static void DumpStats() {
+  fprintf(stderr, "=== kaleidoscope -stats ===\n");
+  fprintf(stderr, "tokens lexed:       %llu\n",
+          (unsigned long long)S->NumTokensLexed);
+  fprintf(stderr, "AST nodes:          %llu\n",
+          (unsigned long long)S->NumASTNodes);
+  fprintf(stderr, "functions compiled: %llu\n",
+          (unsigned long long)S->NumFunctionsCompiled.load());
+  fprintf(stderr, "modules JITed:      %llu\n",
+          (unsigned long long)S->NumModulesJITed);
+
+  S->statsGroup.print(llvm::errs(), /*ResetAfterPrint=*/true);
+}
+
+//----------------------------------------------------------------------------//
+//                                Lexer input
+//----------------------------------------------------------------------------//
+
+// When a source file is given the whole file is mapped (or read) into one
+// buffer and the lexer scans a raw cursor over it, which avoids a libc call
+// per character. With no file the lexer falls back to getchar() so the REPL
+// keeps working on stdin.
+
+
+static bool OpenInputFile(const char *Path) {
+  int Fd = open(Path, O_RDONLY);
+
+  if (Fd < 0) {
+    fprintf(stderr, "[LogError]: could not open '%s'\n", Path);
+
+    return false;
+  }
+
+  struct stat St;
+
+  if (fstat(Fd, &St) != 0) {
+    close(Fd);
+
+    return false;
+  }
+
+  S->MappedInputSize = St.st_size;
+
+  if (S->MappedInputSize > 0) {
+    void *Mapping = mmap(nullptr, S->MappedInputSize, PROT_READ, MAP_PRIVATE, Fd, 0);
+
+    if (Mapping != MAP_FAILED) {
+      S->MappedInput = (char *)Mapping;
+      S->InputIsMapped = true;
+    } else {
+      // mmap can fail on pipes and some filesystems; fall back to reading the
+      // file into a heap buffer in large blocks.
+      S->MappedInput = (char *)malloc(S->MappedInputSize);
+
+      size_t Total = 0;
+
+      while (Total < S->MappedInputSize) {
+        ssize_t N = read(Fd, S->MappedInput + Total, S->MappedInputSize - Total);
+
+        if (N <= 0)
+          break;
+
+        Total += N;
+      }
+
+      S->MappedInputSize = Total;
+    }
+  }
+
+  close(Fd);
+
+  S->InputCursor = S->MappedInput;
+  S->InputEnd = S->MappedInput + S->MappedInputSize;
+
+  return true;
+}
+
+static void CloseInputFile() {
+  if (!S->MappedInput)
+    return;
+
+  if (S->InputIsMapped)
+    munmap(S->MappedInput, S->MappedInputSize);
+  else
+    free(S->MappedInput);
+
+  S->MappedInput = nullptr;
+  S->InputCursor = S->InputEnd = nullptr;
+}
+
+static bool InputIsFile() { return S->InputCursor != nullptr; }
+
+
+static bool ShouldPrintIR() { return !InputIsFile() || S->EmitIR; }
+
+// getnextchar - Single entry point the lexer pulls characters through: a
+// cursor increment on the buffered path, getchar() on the REPL path.
+static int getnextchar() {
+  if (S->InputCursor) {
+    if (S->InputCursor == S->InputEnd)
+      return EOF;
+
+    return (unsigned char)*S->InputCursor++;
+  }
+
+  return getchar();
+}
+
+enum Token {
+  tok_eof = -1,
+
+  tok_def = -2,
+  tok_extern = -3,
+
+  tok_identifier = -4,
+  tok_number = -5,
+
+  tok_var = -6,
+  tok_in = -7,
+
+  tok_if = -8,
+  tok_then = -9,
+  tok_else = -10,
+  tok_for = -11,
+
+  // Emitted for malformed numeric literals; it matches no parser production,
+  // so the surrounding unit fails like any other syntax error.
+  tok_error = -12
+};
+
+
+
+
+// LookupKeyword - Classify the identifier sitting in IdentifierStr. Dispatch
+// on length and then first character so the common case (not a keyword) is
+// decided in a couple of comparisons rather than a chain of full string
+// compares; new keywords get a slot in the switch.
+static int LookupKeyword() {
+  const char *P = S->IdentifierStr.data();
+
+  switch (S->IdentifierStr.size()) {
+  case 2:
+    if (P[0] == 'i')
+      return P[1] == 'n' ? tok_in : P[1] == 'f' ? tok_if : tok_identifier;
+    break;
+  case 3:
+    if (P[0] == 'd' && P[1] == 'e' && P[2] == 'f')
+      return tok_def;
+    if (P[0] == 'v' && P[1] == 'a' && P[2] == 'r')
+      return tok_var;
+    if (P[0] == 'f' && P[1] == 'o' && P[2] == 'r')
+      return tok_for;
+    break;
+  case 4:
+    if (P[0] == 't' && memcmp(P, "then", 4) == 0)
+      return tok_then;
+    if (P[0] == 'e' && memcmp(P, "else", 4) == 0)
+      return tok_else;
+    break;
+  case 6:
+    if (P[0] == 'e' && memcmp(P, "extern", 6) == 0)
+      return tok_extern;
+    break;
+  }
+
+  return tok_identifier;
+}
+
+
+
+// ResetLexer - Point the lexer at a new in-memory buffer and discard any
+// lookahead. Used by harnesses that feed several inputs through one process.
+static void ResetLexer(const char *Begin, const char *End) {
+  S->InputCursor = Begin;
+  S->InputEnd = End;
+
+  S->LastChar = ' ';
+
+  S->TokenRingHead = S->TokenRingTail = 0;
+}
+
+static int gettok() {
+  // Whitespace
+  while (isspace(S->LastChar))
+    S->LastChar = getnextchar();
+
+  // Identifier: [a-zA-Z_][a-zA-Z0-9_]*
+  if (isalpha(S->LastChar) || S->LastChar == '_') {
+    // Reuse the buffer; clear() keeps its capacity, so steady-state lexing of
+    // identifiers does no allocation at all.
+    S->IdentifierStr.clear();
+
+    do {
+      S->IdentifierStr += (char)S->LastChar;
+      S->LastChar = getnextchar();
+    } while (isalnum(S->LastChar) || S->LastChar == '_');
+
+    int Tok = LookupKeyword();
+
+    if (Tok == tok_identifier)
+      S->IdentifierID = S->symbolTable.intern(S->IdentifierStr);
+
+    return Tok;
+  }
+
+  // Number: [0-9]+ ('.' [0-9]*)? or '.' [0-9]+
+  if (isdigit(S->LastChar) || S->LastChar == '.') {
+    // Digits convert as they stream past: an integer mantissa plus a count
+    // of fractional digits, combined with one division by an exact power of
+    // ten. When the mantissa fits in 53 bits and the power is in the table,
+    // that single operation is correctly rounded (the from_chars-style fast
+    // path), which covers essentially every literal real inputs contain;
+    // anything longer falls back to strtod on the reused spelling buffer.
+    // No temporary string is built either way, and malformed literals like
+    // 1.2.3 fail here instead of producing a wrong constant.
+    S->IdentifierStr.clear();
+
+    uint64_t Mantissa = 0;
+
+    int Digits = 0;
+    int FracDigits = 0;
+
+    bool SawDot = false;
+    bool SawDigit = false;
+
+    for (;;) {
+      if (isdigit(S->LastChar)) {
+        SawDigit = true;
+
+        if (Digits < 19) {
+          Mantissa = Mantissa * 10 + (unsigned)(S->LastChar - '0');
+
+          // Leading zeros are not significant; only count digits once the
+          // mantissa is nonzero so they cannot force the fallback.
+          if (Mantissa)
+            ++Digits;
+        } else {
+          ++Digits;
+        }
+
+        if (SawDot)
+          ++FracDigits;
+      } else if (S->LastChar == '.') {
+        if (SawDot)
+          break;
+
+        SawDot = true;
+      } else {
+        break;
+      }
+
+      S->IdentifierStr += (char)S->LastChar;
+
+      S->LastChar = getnextchar();
+    }
+
+    // Reject a second dot or a literal running straight into an identifier
+    // (1.2.3, 12abc), consuming the malformed tail so the parser never sees
+    // it as fresh tokens.
+    if (!SawDigit || S->LastChar == '.' || isalpha(S->LastChar) ||
+        S->LastChar == '_') {
+      while (isalnum(S->LastChar) || S->LastChar == '.' ||
+             S->LastChar == '_')
+        S->LastChar = getnextchar();
+
+      fprintf(stderr, "[LogError]: malformed numeric literal.\n");
+
+      return tok_error;
+    }
+
+    // Exact double powers of ten; beyond 1e22 the division would round
+    // twice.
+    static const double PowersOfTen[] = {
+        1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10,
+        1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21,
+        1e22};
+
+    if (Digits <= 19 && FracDigits <= 22 && (Mantissa >> 53) == 0)
+      S->NumVal = (double)Mantissa / PowersOfTen[FracDigits];
+    else
+      S->NumVal = strtod(S->IdentifierStr.c_str(), nullptr);
+
+    return tok_number;
+  }
+
+  // Handle comments.
+  if (S->LastChar == '#') {
+    do
+      S->LastChar = getnextchar();
+    while (S->LastChar != EOF && S->LastChar != '\n' && S->LastChar != '\r');
+
+    if (S->LastChar != EOF)
+      return gettok();
+  }
+
+  // Check for end of file.
+  if (S->LastChar == EOF)
+    return tok_eof;
+
+  int ThisChar = S->LastChar;
+
+  S->LastChar = getnextchar();
+
+  return ThisChar;
+}
+
+
+// FillTokenRing - Lex ahead until MinAvail tokens are buffered. File input is
+// lexed in full batches since the bytes are already in memory; interactive
+// input lexes only what was asked for, so the prompt never blocks on tokens
+// that have not been typed yet.
+static void FillTokenRing(size_t MinAvail) {
+  size_t Target = InputIsFile() ? TokenRingSize : MinAvail;
+
+  if (S->ShowStats)
+    S->lexTimer.startTimer();
+
+  while (S->TokenRingTail - S->TokenRingHead < Target) {
+    LexedToken &T = S->TokenRing[S->TokenRingTail & (TokenRingSize - 1)];
+
+    T.Kind = gettok();
+    T.Num = S->NumVal;
+    T.Ident = S->IdentifierID;
+
+    ++S->TokenRingTail;
+    ++S->NumTokensLexed;
+
+    if (T.Kind == tok_eof)
+      break;
+  }
+
+  if (S->ShowStats)
+    S->lexTimer.stopTimer();
+}
+
+// PeekTok - The token N places ahead of the one the parser is looking at,
+// without consuming anything. N is capped by the ring size.
+static const LexedToken &PeekTok(size_t N) {
+  if (S->TokenRingTail - S->TokenRingHead <= N)
+    FillTokenRing(N + 1);
+
+  if (S->TokenRingHead + N >= S->TokenRingTail)
+    return S->TokenRing[(S->TokenRingTail - 1) & (TokenRingSize - 1)]; // at EOF
+
+  return S->TokenRing[(S->TokenRingHead + N) & (TokenRingSize - 1)];
+}
+
+// ConsumeTok - Pop the front token into the lexer's current-token globals.
+static const LexedToken &ConsumeTok() {
+  const LexedToken &T = PeekTok(0);
+
+  S->NumVal = T.Num;
+  S->IdentifierID = T.Ident;
+
+  if (T.Kind != tok_eof)
+    ++S->TokenRingHead;
+
+  return T;
+}
+
+//----------------------------------------------------------------------------//
+//                             AST arena allocator
+//----------------------------------------------------------------------------//
+
+
+
+
+//----------------------------------------------------------------------------//
+//                                 Parser
+//----------------------------------------------------------------------------//
+
+static int getNextToken() { return S->CurTok = ConsumeTok().Kind; }
+
+// PeekTokenKind - Kind of the token N places past CurTok without consuming
+// anything; PeekTokenKind(0) is the token getNextToken() would make current.
+static int PeekTokenKind(size_t N) { return PeekTok(N).Kind; }
+
+
+static int GetTokPrecedence() {
+  if (!isascii(S->CurTok))
+    return -1;
+
+  int TokPrec = S->BinopPrecedence[(unsigned char)S->CurTok];
+
+  if (TokPrec <= 0)
+    return -1;
+
+  return TokPrec;
+}
+
+ExprAST *LogError(const char *Str) {
+  fprintf(stderr, "[LogError]: %s\n", Str);
+
+  return nullptr;
+}
+
+std::unique_ptr<PrototypeAST> LogErrorP(const char *Str) {
+  LogError(Str);
+
+  return nullptr;
+}
+
+static ExprAST *ParseExpression();
+
+static ExprAST *ParseNumberExpr() {
+  auto *Result = S->astArena.make<NumberExprAST>(S->NumVal);
+
+  getNextToken();
+
+  return Result;
+}
+
+static ExprAST *ParseIdentifierExpr() {
+  unsigned IdName = S->IdentifierID;
+
+  getNextToken();
+
+  if (S->CurTok != '(')
+    return S->astArena.make<VariableExprAST>(IdName);
+
+  getNextToken();
+
+  llvm::SmallVector<ExprAST *, 4> Args;
+
+  if (S->CurTok != ')') {
+    while (1) {
+      if (auto *Arg = ParseExpression())
+        Args.push_back(Arg);
+      else
+        return nullptr;
+
+      if (S->CurTok == ')')
+        break;
+
+      if (S->CurTok != ',')
+        return LogError("Expected ')' or ',' in the argument list.");
+
+      getNextToken();
+    }
+  }
+
+  getNextToken();
+
+  return S->astArena.make<CallExprAST>(IdName, std::move(Args));
+}
+
+// ParseIfExpr - if expression then expression else expression
+static ExprAST *ParseIfExpr() {
+  getNextToken();
+
+  auto *Cond = ParseExpression();
+
+  if (!Cond)
+    return nullptr;
+
+  if (S->CurTok != tok_then)
+    return LogError("Expected 'then'.");
+
+  getNextToken();
+
+  auto *Then = ParseExpression();
+
+  if (!Then)
+    return nullptr;
+
+  if (S->CurTok != tok_else)
+    return LogError("Expected 'else'.");
+
+  getNextToken();
+
+  auto *Else = ParseExpression();
+
+  if (!Else)
+    return nullptr;
+
+  return S->astArena.make<IfExprAST>(Cond, Then, Else);
+}
+
+// ParseForExpr - for identifier '=' expression ',' expression
+//                    (',' expression)? 'in' expression
+static ExprAST *ParseForExpr() {
+  getNextToken();
+
+  if (S->CurTok != tok_identifier)
+    return LogError("Expected identifier after 'for'.");
+
+  unsigned VarName = S->IdentifierID;
+
+  getNextToken();
+
+  if (S->CurTok != '=')
+    return LogError("Expected '=' after 'for'.");
+
+  getNextToken();
+
+  auto *Start = ParseExpression();
+
+  if (!Start)
+    return nullptr;
+
+  if (S->CurTok != ',')
+    return LogError("Expected ',' after 'for' start value.");
+
+  getNextToken();
+
+  auto *End = ParseExpression();
+
+  if (!End)
+    return nullptr;
+
+  // The step value is optional.
+  ExprAST *Step = nullptr;
+
+  if (S->CurTok == ',') {
+    getNextToken();
+
+    Step = ParseExpression();
+
+    if (!Step)
+      return nullptr;
+  }
+
+  if (S->CurTok != tok_in)
+    return LogError("Expected 'in' after 'for'.");
+
+  getNextToken();
+
+  auto *Body = ParseExpression();
+
+  if (!Body)
+    return nullptr;
+
+  return S->astArena.make<ForExprAST>(VarName, Start, End, Step, Body);
+}
+
+// ParseVarExpr - var identifier ('=' expression)?
+//                    (',' identifier ('=' expression)?)* 'in' expression
+static ExprAST *ParseVarExpr() {
+  getNextToken();
+
+  if (S->CurTok != tok_identifier)
+    return LogError("Expected identifier after 'var'.");
+
+  llvm::SmallVector<std::pair<unsigned, ExprAST *>, 4> VarNames;
+
+  while (1) {
+    unsigned Name = S->IdentifierID;
+
+    getNextToken();
+
+    ExprAST *Init = nullptr;
+
+    if (S->CurTok == '=') {
+      getNextToken();
+
+      Init = ParseExpression();
+
+      if (!Init)
+        return nullptr;
+    }
+
+    VarNames.emplace_back(Name, Init);
+
+    if (S->CurTok != ',')
+      break;
+
+    getNextToken();
+
+    if (S->CurTok != tok_identifier)
+      return LogError("Expected identifier list after 'var'.");
+  }
+
+  if (S->CurTok != tok_in)
+    return LogError("Expected 'in' keyword after 'var'.");
+
+  getNextToken();
+
+  auto *Body = ParseExpression();
+
+  if (!Body)
+    return nullptr;
+
+  return S->astArena.make<VarExprAST>(std::move(VarNames), Body);
+}
+
+static ExprAST *ParsePrimary() {
+  switch (S->CurTok) {
+  default:
+    return LogError("Unkown token when expecting expression.");
+  case tok_identifier:
+    return ParseIdentifierExpr();
+  case tok_number:
+    return ParseNumberExpr();
+  case tok_var:
+    return ParseVarExpr();
+  case tok_if:
+    return ParseIfExpr();
+  case tok_for:
+    return ParseForExpr();
+  }
+}
+
+// ParseParenExpr - Grouping under a unary operator, as in !(a < b). The main
+// expression loop handles its own parens on an explicit stack; this recursive
+// entry only nests as deep as unary applications do.
+static ExprAST *ParseParenExpr() {
+  getNextToken();
+
+  ExprAST *V = ParseExpression();
+
+  if (!V)
+    return nullptr;
+
+  if (S->CurTok != ')')
+    return LogError("expected ')'");
+
+  getNextToken();
+
+  return V;
+}
+
+// ParseUnary - A primary, optionally under a chain of unary operators. Unary
+// applications bind tighter than any binary operator: !x < y is (!x) < y.
+static ExprAST *ParseUnary() {
+  // Anything that cannot be an operator character is a primary; stray
+  // structural tokens fall through for ParsePrimary's error.
+  if (S->CurTok < 0 || S->CurTok == ',' || S->CurTok == ')' || S->CurTok == ';')
+    return ParsePrimary();
+
+  if (S->CurTok == '(')
+    return ParseParenExpr();
+
+  int Opc = S->CurTok;
+
+  getNextToken();
+
+  if (ExprAST *Operand = ParseUnary())
+    return S->astArena.make<UnaryExprAST>(
+        (char)Opc, S->symbolTable.intern(std::string("unary") + (char)Opc),
+        Operand);
+
+  return nullptr;
+}
+
+// FoldBinOp - Compile-time constant folding. When both operands are literals
+// the operator is evaluated now and a single NumberExprAST comes back, so
+// code-generated input full of constant subexpressions shrinks both the tree
+// and the IR the backend has to chew through; returns null when the operands
+// are not both constant (or the operator has no compile-time semantics) and
+// a BinaryExprAST should be built as usual.
+static ExprAST *FoldBinOp(char Op, ExprAST *LHS, ExprAST *RHS) {
+  const NumberExprAST *L = LHS->asNumber();
+  const NumberExprAST *R = RHS->asNumber();
+
+  if (!L || !R)
+    return nullptr;
+
+  double LV = L->getVal();
+  double RV = R->getVal();
+
+  switch (Op) {
+  case '+':
+    return S->astArena.make<NumberExprAST>(LV + RV);
+  case '-':
+    return S->astArena.make<NumberExprAST>(LV - RV);
+  case '*':
+    return S->astArena.make<NumberExprAST>(LV * RV);
+  case '<':
+    return S->astArena.make<NumberExprAST>(LV < RV ? 1.0 : 0.0);
+  default:
+    return nullptr;
+  }
+}
+
+// ParseExpression - Iterative shunting-yard loop over
+// "primary (op primary)*" with '(' ')' grouping. Pending operands and
+// operators live on explicit stacks and get reduced as soon as the incoming
+// operator stops binding tighter, so machine-generated input with 50k+ chained
+// operators or nested parens parses in linear time with flat stack usage
+// instead of one native frame per precedence climb or paren level.
+static ExprAST *ParseExpression() {
+  std::vector<ExprAST *> Operands;
+  std::vector<char> Ops; // binary operator chars plus '(' group markers
+
+  int ParenDepth = 0;
+
+  auto Reduce = [&Operands, &Ops]() {
+    ExprAST *RHS = Operands.back();
+
+    Operands.pop_back();
+
+    ExprAST *LHS = Operands.back();
+
+    Operands.pop_back();
+
+    char BinOp = Ops.back();
+
+    Ops.pop_back();
+
+    // Constant subtrees collapse bottom-up as they reduce, so a run of
+    // literals never materializes a BinaryExprAST at all.
+    if (auto *Folded = FoldBinOp(BinOp, LHS, RHS)) {
+      Operands.push_back(Folded);
+
+      return;
+    }
+
+    // User-defined operators lower to a call of their implementing function;
+    // resolve its interned name here so codegen never touches the table.
+    unsigned FnName = 0;
+
+    switch (BinOp) {
+    case '=':
+    case '+':
+    case '-':
+    case '*':
+    case '<':
+      break;
+    default:
+      FnName = S->symbolTable.intern(std::string("binary") + BinOp);
+      break;
+    }
+
+    Operands.push_back(S->astArena.make<BinaryExprAST>(BinOp, LHS, RHS, FnName));
+  };
+
+  while (1) {
+    // Operand position: swallow any run of opening parens, then a primary.
+    while (S->CurTok == '(') {
+      Ops.push_back('(');
+
+      ++ParenDepth;
+
+      getNextToken();
+    }
+
+    auto *Operand = ParseUnary();
+
+    if (!Operand)
+      return nullptr;
+
+    Operands.push_back(Operand);
+
+    // Operator position: close finished groups, then either stack the next
+    // operator or flush everything and hand the tree back.
+    while (1) {
+      if (S->CurTok == ')' && ParenDepth > 0) {
+        while (Ops.back() != '(')
+          Reduce();
+
+        Ops.pop_back();
+
+        --ParenDepth;
+
+        getNextToken();
+
+        continue;
+      }
+
+      int TokPrec = GetTokPrecedence();
+
+      if (TokPrec < 0) {
+        if (ParenDepth > 0)
+          return LogError("expected ')'");
+
+        while (!Ops.empty())
+          Reduce();
+
+        return Operands.back();
+      }
+
+      // Left associativity: reduce stacked operators that bind at least as
+      // tightly before stacking this one.
+      while (!Ops.empty() && Ops.back() != '(' &&
+             S->BinopPrecedence[(unsigned char)Ops.back()] >= TokPrec)
+        Reduce();
+
+      Ops.push_back((char)S->CurTok);
+
+      getNextToken();
+
+      break;
+    }
+  }
+}
+
+
+static std::unique_ptr<PrototypeAST> ParsePrototype() {
+  if (S->CurTok != tok_identifier)
+    return LogErrorP("Expected function in prototype.");
+
+  unsigned FnName = S->IdentifierID;
+
+  int OperatorKind = 0; // 0 = plain function, 1 = unary, 2 = binary
+  char Op = 0;
+  int Precedence = 30;
+
+  if ((FnName == S->BinaryKwID || FnName == S->UnaryKwID) && PeekTokenKind(0) != '(') {
+    OperatorKind = FnName == S->BinaryKwID ? 2 : 1;
+
+    getNextToken();
+
+    if (S->CurTok < 0 || !isascii(S->CurTok))
+      return LogErrorP("Expected operator character after binary/unary.");
+
+    Op = (char)S->CurTok;
+
+    // The implementing function is named after the operator ("binary|"),
+    // registered and resolved like any other definition.
+    FnName =
+        S->symbolTable.intern(std::string(OperatorKind == 2 ? "binary" : "unary") +
+                           Op);
+
+    getNextToken();
+
+    if (OperatorKind == 2 && S->CurTok == tok_number) {
+      if (S->NumVal < 1 || S->NumVal > 100)
+        return LogErrorP("Invalid precedence: must be 1..100.");
+
+      Precedence = (int)S->NumVal;
+
+      getNextToken();
+    }
+  } else {
+    getNextToken();
+  }
+
+  if (S->CurTok != '(')
+    return LogErrorP("Expected '(' in prototype.");
+
+  std::vector<unsigned> ArgNames;
+
+  while (getNextToken() == tok_identifier) {
+    ArgNames.push_back(S->IdentifierID);
+  }
+
+  if (S->CurTok != ')')
+    return LogErrorP("Expected ')' in prototype.");
+
+  getNextToken();
+
+  if (OperatorKind == 1 && ArgNames.size() != 1)
+    return LogErrorP("Unary operator takes exactly one operand.");
+
+  if (OperatorKind == 2 && ArgNames.size() != 2)
+    return LogErrorP("Binary operator takes exactly two operands.");
+
+  // Install the precedence now, at parse time, so the very next expression
+  // can use the operator whether codegen is eager, lazy, or parallel. The
+  // flat 256-entry table keeps GetTokPrecedence() a single load no matter
+  // how many operators a session registers.
+  if (OperatorKind == 2)
+    S->BinopPrecedence[(unsigned char)Op] = Precedence;
+
+  return std::make_unique<PrototypeAST>(FnName, std::move(ArgNames));
+}
+
+static std::unique_ptr<FunctionAST> ParseDefinition() {
+  getNextToken();
+
+  auto Proto = ParsePrototype();
+
+  if (!Proto)
+    return nullptr;
+
+  if (auto *E = ParseExpression())
+    return std::make_unique<FunctionAST>(std::move(Proto), E);
+
+  return nullptr;
+}
+
+static std::unique_ptr<FunctionAST> ParseTopLevelExpr() {
+  if (auto *E = ParseExpression()) {
+    // Every evaluation gets a distinct name: once its module has moved into
+    // the JIT the symbol stays defined there, so the name cannot be reused.
+    auto Proto = std::make_unique<PrototypeAST>(
+        S->symbolTable.intern("__anon_expr." + std::to_string(S->AnonCount++)),
+        std::vector<unsigned>());
+
+    return std::make_unique<FunctionAST>(std::move(Proto), E);
+  }
+
+  return nullptr;
+}
+
+static std::unique_ptr<PrototypeAST> ParseExtern() {
+  getNextToken();
+
+  return ParsePrototype();
+}
+
+//----------------------------------------------------------------------------//
+//                            Top-Level parsing
+//----------------------------------------------------------------------------//
+
+
+
+
+
+static void RegisterPrototype(const PrototypeAST &Proto) {
+  auto It = S->functionProtos.find(Proto.getNameID());
+
+  if (It != S->functionProtos.end())
+    It->second = Proto;
+  else
+    S->functionProtos.emplace(Proto.getNameID(), Proto);
+}
+
+// JITSymbolName - The symbol a name resolves to right now. The first
+// definition owns the plain spelling; each redefinition moves the name to a
+// ".N" suffixed symbol, since the JIT cannot replace a symbol a committed
+// module already defines.
+static std::string JITSymbolName(unsigned Name) {
+  auto It = S->symbolVersions.find(Name);
+
+  if (It == S->symbolVersions.end() || It->second == 0)
+    return S->symbolTable.spelling(Name);
+
+  return S->symbolTable.spelling(Name) + "." + std::to_string(It->second);
+}
+
+// getFunction - Resolve a name in the current module, falling back to a
+// fresh declaration from the registry when the body already lives in a module
+// the JIT owns. Hits in the inline cache first; every resolution path feeds
+// the cache so repeated calls to the same callee cost one load.
+static llvm::Function *getFunction(unsigned Name) {
+  if (auto *Cached = CG->functionCache.lookup(Name))
+    return Cached;
+
+  llvm::Function *F = CG->module->getFunction(JITSymbolName(Name));
+
+  if (!F) {
+    auto It = S->functionProtos.find(Name);
+
+    if (It != S->functionProtos.end())
+      F = It->second.codegen();
+  }
+
+  if (F)
+    CG->functionCache.insert(Name, F);
+
+  return F;
+}
+
+
+
+
+// MaterializePendingFunction - Codegen a deferred definition on first use.
+// This runs nested inside the caller's own codegen, so the builder position
+// and the live scope are saved around it. The prototype goes into the
+// registry at the same time: once the surrounding module reaches the JIT the
+// body is compiled for good, and later modules only need a declaration.
+static llvm::Function *MaterializePendingFunction(unsigned Name) {
+  auto It = S->pendingFunctions.find(Name);
+
+  if (It == S->pendingFunctions.end())
+    return nullptr;
+
+  std::unique_ptr<FunctionAST> FnAST = std::move(It->second);
+
+  S->pendingFunctions.erase(It);
+
+  RegisterPrototype(FnAST->getProto());
+
+  auto SavedIP = CG->irBuilder->saveIP();
+  ScopeMap SavedScope = CG->namedValues;
+
+  llvm::Function *F = FnAST->codegen();
+
+  CG->namedValues = SavedScope;
+
+  CG->irBuilder->restoreIP(SavedIP);
+
+  return F;
+}
+
+
+static void HandleDefinition() {
+  std::unique_ptr<FunctionAST> FnAST;
+
+  {
+    llvm::TimeRegion PT(S->ShowStats ? &S->parseTimer : nullptr);
+
+    FnAST = ParseDefinition();
+  }
+
+  if (!FnAST) {
+    getNextToken();
+
+    return;
+  }
+
+  if (S->LazyCodegen) {
+    // Register only; the body is codegenned the first time a call resolves
+    // to this name. Redefinition replaces the pending entry.
+    S->pendingFunctions[FnAST->getProto().getNameID()] = std::move(FnAST);
+
+    return;
+  }
+
+  RegisterPrototype(FnAST->getProto());
+
+  llvm::Function *FnIR;
+
+  {
+    llvm::TimeRegion CT(S->ShowStats ? &S->codegenTimer : nullptr);
+
+    FnIR = FnAST->codegen();
+  }
+
+  if (FnIR && ShouldPrintIR()) {
+    fprintf(stderr, "Read function definitions:");
+
+    FnIR->print(llvm::errs());
+
+    fprintf(stderr, "\n");
+  }
+}
+
+static void HandleExtern() {
+  std::unique_ptr<PrototypeAST> ProtoAST;
+
+  {
+    llvm::TimeRegion PT(S->ShowStats ? &S->parseTimer : nullptr);
+
+    ProtoAST = ParseExtern();
+  }
+
+  if (!ProtoAST) {
+    getNextToken();
+
+    return;
+  }
+
+  RegisterPrototype(*ProtoAST);
+
+  if (auto *FnIR = ProtoAST->codegen()) {
+    if (ShouldPrintIR()) {
+      fprintf(stderr, "Read extern.");
+
+      FnIR->print(llvm::errs());
+
+      fprintf(stderr, "\n");
+    }
+  }
+}
+
+
+static void InitializeModule();
+
+// CloneModuleForJIT - Round-trip the live module through bitcode into a fresh
+// context and give the JIT the copy. Only the emission path still pays for
+// this: it needs every definition to stay in the live module for the object
+// writer, so evaluation cannot hand the module itself to the JIT.
+static llvm::orc::ThreadSafeModule CloneModuleForJIT() {
+  llvm::SmallString<0> Buffer;
+  llvm::raw_svector_ostream BCStream(Buffer);
+
+  llvm::WriteBitcodeToFile(*CG->module, BCStream);
+
+  auto CloneContext = std::make_unique<llvm::LLVMContext>();
+
+  auto Clone = llvm::parseBitcodeFile(
+      llvm::MemoryBufferRef(Buffer.str(), CG->module->getName()), *CloneContext);
+
+  if (!Clone) {
+    llvm::logAllUnhandledErrors(Clone.takeError(), llvm::errs(),
+                                "[LogError]: ");
+
+    return llvm::orc::ThreadSafeModule();
+  }
+
+  return llvm::orc::ThreadSafeModule(std::move(*Clone),
+                                     std::move(CloneContext));
+}
+
+static void HandleTopLevelExpression() {
+  std::unique_ptr<FunctionAST> FnAST;
+
+  {
+    llvm::TimeRegion PT(S->ShowStats ? &S->parseTimer : nullptr);
+
+    FnAST = ParseTopLevelExpr();
+  }
+
+  if (FnAST) {
+    llvm::Function *FnIR;
+
+    {
+      llvm::TimeRegion CT(S->ShowStats ? &S->codegenTimer : nullptr);
+
+      FnIR = FnAST->codegen();
+    }
+
+    if (FnIR) {
+      // The module moves out from under us below; keep the symbol name.
+      std::string SymName = FnAST->getProto().getName();
+
+      llvm::orc::ResourceTrackerSP RT;
+      double (*FP)() = nullptr;
+
+      {
+        // Scoped so the jit timer covers module handoff, backend
+        // compilation, and symbol resolution but not running the expression.
+        llvm::TimeRegion JT(S->ShowStats ? &S->jitTimer : nullptr);
+
+        if (S->KeepModuleForEmission) {
+          // Emission still needs every definition in the live module, so the
+          // JIT gets a bitcode clone and the anonymous function is dropped
+          // from the original after the copy is taken.
+          RT = S->theJIT->getMainJITDylib().createResourceTracker();
+
+          auto TSM = CloneModuleForJIT();
+
+          FnIR->eraseFromParent();
+
+          if (!TSM)
+            return;
+
+          if (auto Err = S->theJIT->addIRModule(RT, std::move(TSM))) {
+            llvm::logAllUnhandledErrors(std::move(Err), llvm::errs(),
+                                        "[LogError]: ");
+
+            return;
+          }
+        } else {
+          // Hand the whole module -- this expression plus any definitions
+          // made since the last one -- to the JIT for good. Later modules
+          // call into it through declarations rebuilt from functionProtos,
+          // resolved by the JIT's symbol table; nothing is ever recompiled.
+          // The definitions' symbols belong to the JIT from here on;
+          // redefining one of them must version its symbol.
+          for (unsigned Def : CG->moduleDefs)
+            S->jitOwnedFunctions.insert(Def);
+
+          if (auto Err = S->theJIT->addIRModule(llvm::orc::ThreadSafeModule(
+                  std::move(CG->module), std::move(CG->llvmContext)))) {
+            llvm::logAllUnhandledErrors(std::move(Err), llvm::errs(),
+                                        "[LogError]: ");
+
+            // The module and context moved out regardless; without a fresh
+            // pair the next unit would codegen into a null module.
+            InitializeModule();
+
+            return;
+          }
+
+          InitializeModule();
+        }
+
+        ++S->NumModulesJITed;
+
+        auto ExprSymbol = S->theJIT->lookup(SymName);
+
+        if (!ExprSymbol) {
+          llvm::logAllUnhandledErrors(ExprSymbol.takeError(), llvm::errs(),
+                                      "[LogError]: ");
+
+          return;
+        }
+
+        FP = (double (*)())(intptr_t)ExprSymbol->getAddress();
+      }
+
+      S->LastValue = FP();
+      S->HaveValue = true;
+
+      if (S->PrintResults)
+        fprintf(stderr, "Evaluated to %f\n", S->LastValue);
+
+      if (RT)
+        if (auto Err = RT->remove())
+          llvm::logAllUnhandledErrors(std::move(Err), llvm::errs(),
+                                      "[LogError]: ");
+    }
+  } else {
+    getNextToken();
+  }
+}
+
+// ---------------------------------------------------
+
+llvm::Value *LogErrorV(const char *Str) {
+  LogError(Str);
+
+  return nullptr;
+}
+
+llvm::Value *NumberExprAST::codegen() {
+  return llvm::ConstantFP::get(*CG->llvmContext, llvm::APFloat(Val));
+}
+
+// CreateEntryBlockAlloca - Stack slot for a mutable variable, always placed
+// in the entry block so mem2reg can promote it to a register.
+static llvm::AllocaInst *CreateEntryBlockAlloca(llvm::Function *TheFunction,
+                                                unsigned VarName) {
+  llvm::IRBuilder<> TmpB(&TheFunction->getEntryBlock(),
+                         TheFunction->getEntryBlock().begin());
+
+  return TmpB.CreateAlloca(llvm::Type::getDoubleTy(*CG->llvmContext), nullptr,
+                           S->symbolTable.spelling(VarName));
+}
+
+llvm::Value *VariableExprAST::codegen() {
+  llvm::Value *V = CG->namedValues.lookup(Name);
+
+  if (!V)
+    return LogErrorV("Unkown variable name.");
+
+  return CG->irBuilder->CreateLoad(llvm::Type::getDoubleTy(*CG->llvmContext), V,
+                               S->symbolTable.spelling(Name));
+}
+
+llvm::Value *IfExprAST::codegen() {
+  llvm::Value *CondV = Cond->codegen();
+
+  if (!CondV)
+    return nullptr;
+
+  CondV = CG->irBuilder->CreateFCmpONE(
+      CondV, llvm::ConstantFP::get(*CG->llvmContext, llvm::APFloat(0.0)),
+      "ifcond");
+
+  llvm::Function *TheFunction = CG->irBuilder->GetInsertBlock()->getParent();
+
+  llvm::BasicBlock *ThenBB =
+      llvm::BasicBlock::Create(*CG->llvmContext, "then", TheFunction);
+  llvm::BasicBlock *ElseBB = llvm::BasicBlock::Create(*CG->llvmContext, "else");
+  llvm::BasicBlock *MergeBB = llvm::BasicBlock::Create(*CG->llvmContext, "ifcont");
+
+  CG->irBuilder->CreateCondBr(CondV, ThenBB, ElseBB);
+
+  CG->irBuilder->SetInsertPoint(ThenBB);
+
+  llvm::Value *ThenV = Then->codegen();
+
+  if (!ThenV)
+    return nullptr;
+
+  CG->irBuilder->CreateBr(MergeBB);
+
+  // Codegen of the then arm can move the insertion block (nested control
+  // flow); the phi needs the block the branch actually came from.
+  ThenBB = CG->irBuilder->GetInsertBlock();
+
+  TheFunction->getBasicBlockList().push_back(ElseBB);
+
+  CG->irBuilder->SetInsertPoint(ElseBB);
+
+  llvm::Value *ElseV = Else->codegen();
+
+  if (!ElseV)
+    return nullptr;
+
+  CG->irBuilder->CreateBr(MergeBB);
+
+  ElseBB = CG->irBuilder->GetInsertBlock();
+
+  TheFunction->getBasicBlockList().push_back(MergeBB);
+
+  CG->irBuilder->SetInsertPoint(MergeBB);
+
+  llvm::PHINode *PN = CG->irBuilder->CreatePHI(
+      llvm::Type::getDoubleTy(*CG->llvmContext), 2, "iftmp");
+
+  PN->addIncoming(ThenV, ThenBB);
+  PN->addIncoming(ElseV, ElseBB);
+
+  return PN;
+}
+
+llvm::Value *ForExprAST::codegen() {
+  llvm::Function *TheFunction = CG->irBuilder->GetInsertBlock()->getParent();
+
+  llvm::AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
+
+  llvm::Value *StartVal = Start->codegen();
+
+  if (!StartVal)
+    return nullptr;
+
+  CG->irBuilder->CreateStore(StartVal, Alloca);
+
+  llvm::BasicBlock *LoopBB =
+      llvm::BasicBlock::Create(*CG->llvmContext, "loop", TheFunction);
+
+  CG->irBuilder->CreateBr(LoopBB);
+
+  CG->irBuilder->SetInsertPoint(LoopBB);
+
+  // The induction variable shadows any outer binding for the duration of the
+  // loop, exactly like a var expression.
+  llvm::Value *OldVal = CG->namedValues.lookup(VarName);
+
+  CG->namedValues.insert(VarName, Alloca);
+
+  if (!Body->codegen())
+    return nullptr;
+
+  llvm::Value *StepVal = nullptr;
+
+  if (Step) {
+    StepVal = Step->codegen();
+
+    if (!StepVal)
+      return nullptr;
+  } else {
+    StepVal = llvm::ConstantFP::get(*CG->llvmContext, llvm::APFloat(1.0));
+  }
+
+  llvm::Value *EndCond = End->codegen();
+
+  if (!EndCond)
+    return nullptr;
+
+  llvm::Value *CurVar = CG->irBuilder->CreateLoad(
+      llvm::Type::getDoubleTy(*CG->llvmContext), Alloca,
+      S->symbolTable.spelling(VarName));
+  llvm::Value *NextVar = CG->irBuilder->CreateFAdd(CurVar, StepVal, "nextvar");
+
+  CG->irBuilder->CreateStore(NextVar, Alloca);
+
+  EndCond = CG->irBuilder->CreateFCmpONE(
+      EndCond, llvm::ConstantFP::get(*CG->llvmContext, llvm::APFloat(0.0)),
+      "loopcond");
+
+  llvm::BasicBlock *AfterBB =
+      llvm::BasicBlock::Create(*CG->llvmContext, "afterloop", TheFunction);
+
+  CG->irBuilder->CreateCondBr(EndCond, LoopBB, AfterBB);
+
+  CG->irBuilder->SetInsertPoint(AfterBB);
+
+  CG->namedValues.insert(VarName, OldVal);
+
+  // The for expression itself always evaluates to 0.0.
+  return llvm::Constant::getNullValue(llvm::Type::getDoubleTy(*CG->llvmContext));
+}
+
+llvm::Value *VarExprAST::codegen() {
+  llvm::Function *TheFunction = CG->irBuilder->GetInsertBlock()->getParent();
+
+  std::vector<std::pair<unsigned, llvm::Value *>> OldBindings;
+
+  for (auto &VarInit : VarNames) {
+    // The initializer is evaluated before the variable is in scope, so
+    // 'var a = a in ...' refers to the outer 'a'.
+    llvm::Value *InitVal =
+        VarInit.second
+            ? VarInit.second->codegen()
+            : llvm::ConstantFP::get(*CG->llvmContext, llvm::APFloat(0.0));
+
+    if (!InitVal)
+      return nullptr;
+
+    llvm::AllocaInst *Alloca =
+        CreateEntryBlockAlloca(TheFunction, VarInit.first);
+
+    CG->irBuilder->CreateStore(InitVal, Alloca);
+
+    OldBindings.emplace_back(VarInit.first,
+                             CG->namedValues.lookup(VarInit.first));
+
+    CG->namedValues.insert(VarInit.first, Alloca);
+  }
+
+  llvm::Value *BodyVal = Body->codegen();
+
+  if (!BodyVal)
+    return nullptr;
+
+  for (auto &Binding : OldBindings)
+    CG->namedValues.insert(Binding.first, Binding.second);
+
+  return BodyVal;
+}
+
+llvm::Value *BinaryExprAST::codegen() {
+  // Assignment is special cased: the left side is a destination slot, not a
+  // value to evaluate.
+  if (Op == '=') {
+    const VariableExprAST *LHSE = LHS->asVariable();
+
+    if (!LHSE)
+      return LogErrorV("Destination of '=' must be a variable.");
+
+    llvm::Value *Val = RHS->codegen();
+
+    if (!Val)
+      return nullptr;
+
+    llvm::Value *Variable = CG->namedValues.lookup(LHSE->getName());
+
+    if (!Variable)
+      return LogErrorV("Unkown variable name.");
+
+    CG->irBuilder->CreateStore(Val, Variable);
+
+    return Val;
+  }
+
+  llvm::Value *L = LHS->codegen();
+  llvm::Value *R = RHS->codegen();
+
+  if (!L || !R)
+    return nullptr;
+
+  // TODO: Add additional binary operators.
+  switch (Op) {
+    case '+':
+      return CG->irBuilder->CreateFAdd(L, R, "addtmp");
+    case '-':
+      return CG->irBuilder->CreateFSub(L, R, "subtmp");
+    case '*':
+      return CG->irBuilder->CreateFMul(L, R, "multmp");
+    case '<':
+      L = CG->irBuilder->CreateFCmpULT(L, R, "cmptmp");
+
+      return CG->irBuilder->CreateUIToFP(L, llvm::Type::getDoubleTy(*CG->llvmContext));
+    default: {
+      // User-defined operator: call its implementing function.
+      llvm::Function *F = getFunction(FnName);
+
+      if (!F && S->LazyCodegen)
+        F = MaterializePendingFunction(FnName);
+
+      if (!F)
+        return LogErrorV("Invalid binary operator.");
+
+      return CG->irBuilder->CreateCall(F, {L, R}, "binop");
+    }
+  }
+}
+
+llvm::Value *UnaryExprAST::codegen() {
+  llvm::Value *OperandV = Operand->codegen();
+
+  if (!OperandV)
+    return nullptr;
+
+  llvm::Function *F = getFunction(FnName);
+
+  if (!F && S->LazyCodegen)
+    F = MaterializePendingFunction(FnName);
+
+  if (!F)
+    return LogErrorV("Unkown unary operator.");
+
+  return CG->irBuilder->CreateCall(F, OperandV, "unop");
+}
+
+//----------------------------------------------------------------------------//
+//                          Builtin vector kernels
+//----------------------------------------------------------------------------//
+
+// Everything in the language is a double, so arrays are passed as
+// address+length pairs carried in doubles (integers up to 2^53 are exact).
+// The builtins below are recognized by name in CallExprAST::codegen() and
+// lower straight to a 4-wide vector loop with a scalar tail -- no extern call
+// and no per-element call boundary. A user definition cannot shadow them.
+//
+//   vadd(dst, a, b, n)       dst[i] = a[i] + b[i]
+//   vmul(dst, a, b, n)       dst[i] = a[i] * b[i]
+//   vfma(dst, a, b, c, n)    dst[i] = a[i] * b[i] + c[i]
+//   reduce_add(src, n)       returns src[0] + ... + src[n-1]
+//
+// The map-style kernels return dst so calls chain.
+
+static const unsigned VecWidth = 4;
+
+
+static bool IsVectorBuiltin(unsigned Name) {
+  return Name == S->VAddID || Name == S->VMulID || Name == S->VFMAID ||
+         Name == S->ReduceAddID;
+}
+
+// PointerFromDouble - Reinterpret an address carried in a double as double*.
+static llvm::Value *PointerFromDouble(llvm::Value *Addr) {
+  llvm::Value *Bits = CG->irBuilder->CreateFPToUI(
+      Addr, llvm::Type::getInt64Ty(*CG->llvmContext), "addrbits");
+
+  return CG->irBuilder->CreateIntToPtr(
+      Bits, llvm::Type::getDoubleTy(*CG->llvmContext)->getPointerTo(), "addrptr");
+}
+
+// EmitElementwiseLoop - Shared skeleton for the map-style kernels:
+// Dst[i] = Op(Srcs[i]...) for i < N, four lanes at a time, then a scalar
+// tail. Op is invoked once with vector operands and once with scalars, so it
+// must only build type-agnostic arithmetic.
+static void EmitElementwiseLoop(
+    llvm::Value *Dst, llvm::ArrayRef<llvm::Value *> Srcs, llvm::Value *CountD,
+    llvm::function_ref<llvm::Value *(llvm::ArrayRef<llvm::Value *>)> Op) {
+  llvm::Function *TheFunction = CG->irBuilder->GetInsertBlock()->getParent();
+
+  auto *I64 = llvm::Type::getInt64Ty(*CG->llvmContext);
+  auto *DoubleTy = llvm::Type::getDoubleTy(*CG->llvmContext);
+  auto *VecTy = llvm::FixedVectorType::get(DoubleTy, VecWidth);
+
+  llvm::Value *N = CG->irBuilder->CreateFPToUI(CountD, I64, "n");
+
+  llvm::Value *VecN = CG->irBuilder->CreateAnd(
+      N, llvm::ConstantInt::get(I64, ~(uint64_t)(VecWidth - 1)), "vecn");
+
+  auto *Preheader = CG->irBuilder->GetInsertBlock();
+
+  auto *VecCond = llvm::BasicBlock::Create(*CG->llvmContext, "veccond", TheFunction);
+  auto *VecBody = llvm::BasicBlock::Create(*CG->llvmContext, "vecbody", TheFunction);
+  auto *TailCond = llvm::BasicBlock::Create(*CG->llvmContext, "tailcond", TheFunction);
+  auto *TailBody = llvm::BasicBlock::Create(*CG->llvmContext, "tailbody", TheFunction);
+  auto *Done = llvm::BasicBlock::Create(*CG->llvmContext, "vecdone", TheFunction);
+
+  CG->irBuilder->CreateBr(VecCond);
+
+  CG->irBuilder->SetInsertPoint(VecCond);
+
+  llvm::PHINode *IV = CG->irBuilder->CreatePHI(I64, 2, "vi");
+
+  IV->addIncoming(llvm::ConstantInt::get(I64, 0), Preheader);
+
+  CG->irBuilder->CreateCondBr(CG->irBuilder->CreateICmpULT(IV, VecN, "veccmp"),
+                          VecBody, TailCond);
+
+  CG->irBuilder->SetInsertPoint(VecBody);
+
+  llvm::SmallVector<llvm::Value *, 3> Lanes;
+
+  for (llvm::Value *Src : Srcs) {
+    llvm::Value *Gep = CG->irBuilder->CreateGEP(DoubleTy, Src, IV, "lanes");
+
+    // Doubles are only 8-byte aligned; unaligned vector loads are cheap on
+    // every target we care about.
+    Lanes.push_back(CG->irBuilder->CreateAlignedLoad(
+        VecTy, CG->irBuilder->CreateBitCast(Gep, VecTy->getPointerTo()),
+        llvm::Align(8)));
+  }
+
+  llvm::Value *DstGep = CG->irBuilder->CreateGEP(DoubleTy, Dst, IV, "dstlanes");
+
+  CG->irBuilder->CreateAlignedStore(
+      Op(Lanes), CG->irBuilder->CreateBitCast(DstGep, VecTy->getPointerTo()),
+      llvm::Align(8));
+
+  llvm::Value *IVNext =
+      CG->irBuilder->CreateAdd(IV, llvm::ConstantInt::get(I64, VecWidth), "vinext");
+
+  IV->addIncoming(IVNext, CG->irBuilder->GetInsertBlock());
+
+  CG->irBuilder->CreateBr(VecCond);
+
+  CG->irBuilder->SetInsertPoint(TailCond);
+
+  llvm::PHINode *SIV = CG->irBuilder->CreatePHI(I64, 2, "ti");
+
+  SIV->addIncoming(IV, VecCond);
+
+  CG->irBuilder->CreateCondBr(CG->irBuilder->CreateICmpULT(SIV, N, "tailcmp"),
+                          TailBody, Done);
+
+  CG->irBuilder->SetInsertPoint(TailBody);
+
+  llvm::SmallVector<llvm::Value *, 3> Elts;
+
+  for (llvm::Value *Src : Srcs)
+    Elts.push_back(CG->irBuilder->CreateLoad(
+        DoubleTy, CG->irBuilder->CreateGEP(DoubleTy, Src, SIV, "elt")));
+
+  CG->irBuilder->CreateStore(Op(Elts),
+                         CG->irBuilder->CreateGEP(DoubleTy, Dst, SIV, "dstelt"));
+
+  llvm::Value *SIVNext =
+      CG->irBuilder->CreateAdd(SIV, llvm::ConstantInt::get(I64, 1), "tinext");
+
+  SIV->addIncoming(SIVNext, CG->irBuilder->GetInsertBlock());
+
+  CG->irBuilder->CreateBr(TailCond);
+
+  CG->irBuilder->SetInsertPoint(Done);
+}
+
+// EmitReduceAdd - Horizontal sum: four partial sums in a vector accumulator,
+// one reduce on loop exit, scalar accumulation for the tail.
+static llvm::Value *EmitReduceAdd(llvm::Value *SrcD, llvm::Value *CountD) {
+  llvm::Function *TheFunction = CG->irBuilder->GetInsertBlock()->getParent();
+
+  auto *I64 = llvm::Type::getInt64Ty(*CG->llvmContext);
+  auto *DoubleTy = llvm::Type::getDoubleTy(*CG->llvmContext);
+  auto *VecTy = llvm::FixedVectorType::get(DoubleTy, VecWidth);
+
+  llvm::Value *Src = PointerFromDouble(SrcD);
+
+  llvm::Value *N = CG->irBuilder->CreateFPToUI(CountD, I64, "n");
+
+  llvm::Value *VecN = CG->irBuilder->CreateAnd(
+      N, llvm::ConstantInt::get(I64, ~(uint64_t)(VecWidth - 1)), "vecn");
+
+  auto *Preheader = CG->irBuilder->GetInsertBlock();
+
+  auto *VecCond = llvm::BasicBlock::Create(*CG->llvmContext, "veccond", TheFunction);
+  auto *VecBody = llvm::BasicBlock::Create(*CG->llvmContext, "vecbody", TheFunction);
+  auto *Middle = llvm::BasicBlock::Create(*CG->llvmContext, "vecmid", TheFunction);
+  auto *TailCond = llvm::BasicBlock::Create(*CG->llvmContext, "tailcond", TheFunction);
+  auto *TailBody = llvm::BasicBlock::Create(*CG->llvmContext, "tailbody", TheFunction);
+  auto *Done = llvm::BasicBlock::Create(*CG->llvmContext, "vecdone", TheFunction);
+
+  CG->irBuilder->CreateBr(VecCond);
+
+  CG->irBuilder->SetInsertPoint(VecCond);
+
+  llvm::PHINode *IV = CG->irBuilder->CreatePHI(I64, 2, "vi");
+  llvm::PHINode *VAcc = CG->irBuilder->CreatePHI(VecTy, 2, "vacc");
+
+  IV->addIncoming(llvm::ConstantInt::get(I64, 0), Preheader);
+  VAcc->addIncoming(llvm::Constant::getNullValue(VecTy), Preheader);
+
+  CG->irBuilder->CreateCondBr(CG->irBuilder->CreateICmpULT(IV, VecN, "veccmp"),
+                          VecBody, Middle);
+
+  CG->irBuilder->SetInsertPoint(VecBody);
+
+  llvm::Value *Gep = CG->irBuilder->CreateGEP(DoubleTy, Src, IV, "lanes");
+
+  llvm::Value *Lanes = CG->irBuilder->CreateAlignedLoad(
+      VecTy, CG->irBuilder->CreateBitCast(Gep, VecTy->getPointerTo()),
+      llvm::Align(8));
+
+  llvm::Value *VAccNext = CG->irBuilder->CreateFAdd(VAcc, Lanes, "vaccnext");
+
+  llvm::Value *IVNext =
+      CG->irBuilder->CreateAdd(IV, llvm::ConstantInt::get(I64, VecWidth), "vinext");
+
+  IV->addIncoming(IVNext, VecBody);
+  VAcc->addIncoming(VAccNext, VecBody);
+
+  CG->irBuilder->CreateBr(VecCond);
+
+  CG->irBuilder->SetInsertPoint(Middle);
+
+  llvm::Value *Partial = CG->irBuilder->CreateFAddReduce(
+      llvm::ConstantFP::get(DoubleTy, 0.0), VAcc);
+
+  CG->irBuilder->CreateBr(TailCond);
+
+  CG->irBuilder->SetInsertPoint(TailCond);
+
+  llvm::PHINode *SIV = CG->irBuilder->CreatePHI(I64, 2, "ti");
+  llvm::PHINode *SAcc = CG->irBuilder->CreatePHI(DoubleTy, 2, "sacc");
+
+  SIV->addIncoming(IV, Middle);
+  SAcc->addIncoming(Partial, Middle);
+
+  CG->irBuilder->CreateCondBr(CG->irBuilder->CreateICmpULT(SIV, N, "tailcmp"),
+                          TailBody, Done);
+
+  CG->irBuilder->SetInsertPoint(TailBody);
+
+  llvm::Value *Elt = CG->irBuilder->CreateLoad(
+      DoubleTy, CG->irBuilder->CreateGEP(DoubleTy, Src, SIV, "elt"));
+
+  llvm::Value *SAccNext = CG->irBuilder->CreateFAdd(SAcc, Elt, "saccnext");
+
+  llvm::Value *SIVNext =
+      CG->irBuilder->CreateAdd(SIV, llvm::ConstantInt::get(I64, 1), "tinext");
+
+  SIV->addIncoming(SIVNext, TailBody);
+  SAcc->addIncoming(SAccNext, TailBody);
+
+  CG->irBuilder->CreateBr(TailCond);
+
+  CG->irBuilder->SetInsertPoint(Done);
+
+  return SAcc;
+}
+
+// EmitVectorBuiltin - Codegen the arguments and dispatch on the builtin name.
+static llvm::Value *EmitVectorBuiltin(unsigned Name,
+                                      llvm::ArrayRef<ExprAST *> ArgExprs) {
+  std::vector<llvm::Value *> Args;
+
+  for (ExprAST *Arg : ArgExprs) {
+    llvm::Value *V = Arg->codegen();
+
+    if (!V)
+      return nullptr;
+
+    Args.push_back(V);
+  }
+
+  if (Name == S->ReduceAddID) {
+    if (Args.size() != 2)
+      return LogErrorV("reduce_add expects (src, n).");
+
+    return EmitReduceAdd(Args[0], Args[1]);
+  }
+
+  if (Name == S->VFMAID) {
+    if (Args.size() != 5)
+      return LogErrorV("vfma expects (dst, a, b, c, n).");
+  } else if (Args.size() != 4) {
+    return LogErrorV("vadd/vmul expect (dst, a, b, n).");
+  }
+
+  llvm::Value *Dst = PointerFromDouble(Args.front());
+
+  llvm::SmallVector<llvm::Value *, 3> Srcs;
+
+  for (size_t i = 1, e = Args.size() - 1; i != e; ++i)
+    Srcs.push_back(PointerFromDouble(Args[i]));
+
+  EmitElementwiseLoop(
+      Dst, Srcs, Args.back(),
+      [Name](llvm::ArrayRef<llvm::Value *> Elts) -> llvm::Value * {
+        if (Name == S->VAddID)
+          return CG->irBuilder->CreateFAdd(Elts[0], Elts[1], "vaddtmp");
+
+        if (Name == S->VMulID)
+          return CG->irBuilder->CreateFMul(Elts[0], Elts[1], "vmultmp");
+
+        return CG->irBuilder->CreateIntrinsic(
+            llvm::Intrinsic::fma, {Elts[0]->getType()},
+            {Elts[0], Elts[1], Elts[2]}, nullptr, "vfmatmp");
+      });
+
+  // The destination address flows through so kernels chain.
+  return Args.front();
+}
+
+llvm::Value *CallExprAST::codegen() {
+  if (IsVectorBuiltin(Calle))
+    return EmitVectorBuiltin(Calle, Args);
+
+  llvm::Function *CalleF = nullptr;
+
+  // A pending definition outranks anything already resolved: under -lazy a
+  // redefinition replaces the pending entry even after an earlier body was
+  // materialized, and this call must bind to the replacement, not to the
+  // registry declaration of the superseded one.
+  if (S->LazyCodegen && S->pendingFunctions.count(Calle))
+    CalleF = MaterializePendingFunction(Calle);
+
+  if (!CalleF)
+    CalleF = getFunction(Calle);
+
+  if (!CalleF)
+    return LogErrorV("Unkown function refrenced.");
+
+  if (CalleF->arg_size() != Args.size())
+    return LogErrorV("Incorrect number of arguments passed.");
+  
+  std::vector<llvm::Value*> ArgsV;
+
+  for (unsigned int i = 0, e = Args.size(); i != e; ++i) {
+    ArgsV.push_back(Args[i]->codegen());
+
+    if (!ArgsV.back())
+      return nullptr;
+  }
+
+  return CG->irBuilder->CreateCall(CalleF, ArgsV, "calltmp");
+}
+
+llvm::Function *PrototypeAST::codegen() {
+  std::vector<llvm::Type*> Doubles(Args.size(), llvm::Type::getDoubleTy(*CG->llvmContext));
+
+  llvm::FunctionType *functionType = llvm::FunctionType::get(llvm::Type::getDoubleTy(*CG->llvmContext), Doubles, false);
+
+  llvm::Function *function =
+      llvm::Function::Create(functionType, llvm::Function::ExternalLinkage,
+                             JITSymbolName(Name), CG->module.get());
+
+  unsigned index = 0;
+
+  for (auto &Arg : function->args()) {
+    Arg.setName(S->symbolTable.spelling(Args[index++]));
+  }
+  
+  return function;
+}
+
+llvm::Function *FunctionAST::codegen() {
+  unsigned NameID = Proto->getNameID();
+
+  llvm::Function *function = CG->module->getFunction(JITSymbolName(NameID));
+
+  // A body the JIT already owns -- or one already finished in the live
+  // module -- cannot be replaced in place, so a redefinition bumps the
+  // symbol version and compiles under the fresh name; call sites codegenned
+  // from here on resolve to it through JITSymbolName().
+  if (S->jitOwnedFunctions.count(NameID) || (function && !function->empty())) {
+    ++S->symbolVersions[NameID];
+
+    S->jitOwnedFunctions.erase(NameID);
+
+    // A cached handle would still point at the superseded version.
+    CG->functionCache.invalidate(NameID);
+
+    function = nullptr;
+  }
+
+  if (!function) function = Proto->codegen();
+
+  if (!function) return nullptr;
+
+  llvm::BasicBlock *BB = llvm::BasicBlock::Create(*CG->llvmContext, "entry", function);
+  
+  CG->irBuilder->SetInsertPoint(BB);
+
+  CG->namedValues.clear();
+
+  unsigned ArgIndex = 0;
+
+  for (auto &Arg : function->args()) {
+    // Arguments live in entry-block allocas like every other variable so they
+    // can be assigned; mem2reg turns the slots back into registers.
+    unsigned ArgName = Proto->getArgs()[ArgIndex++];
+
+    llvm::AllocaInst *Alloca = CreateEntryBlockAlloca(function, ArgName);
+
+    CG->irBuilder->CreateStore(&Arg, Alloca);
+
+    CG->namedValues.insert(ArgName, Alloca);
+  }
+
+  if (llvm::Value *RetVal = Body->codegen()) {
+    CG->irBuilder->CreateRet(RetVal);
+
+    llvm::verifyFunction(*function);
+
+    CG->functionPassManager->run(*function);
+
+    S->NumFunctionsCompiled.fetch_add(1, std::memory_order_relaxed);
+
+    CG->moduleDefs.push_back(NameID);
+
+    return function;
+  }
+
+  function->eraseFromParent();
+
+  // A recursive call in the failed body may have cached the handle.
+  CG->functionCache.invalidate(NameID);
+
+  return nullptr;
+}
+
+
+static void InitializeModule() {
+  CG->llvmContext = std::make_unique<llvm::LLVMContext>();
+  CG->module = std::make_unique<llvm::Module>("My cool Jit!", *CG->llvmContext);
+
+  // Cached llvm::Function* handles pointed into the module just replaced.
+  CG->functionCache.clear();
+
+  CG->moduleDefs.clear();
+
+  CG->module->setDataLayout(S->theJIT->getDataLayout());
+
+  CG->irBuilder = std::make_unique<llvm::IRBuilder<>>(*CG->llvmContext);
+
+  CG->functionPassManager =
+      std::make_unique<llvm::legacy::FunctionPassManager>(CG->module.get());
+
+  if (S->OptLevel >= 1) {
+    // Promote mutable variable slots to SSA registers, then peephole
+    // optimizations and expression reassociation.
+    CG->functionPassManager->add(llvm::createPromoteMemoryToRegisterPass());
+    CG->functionPassManager->add(llvm::createInstructionCombiningPass());
+    CG->functionPassManager->add(llvm::createReassociatePass());
+  }
+
+  if (S->OptLevel >= 2) {
+    // Common subexpression elimination and control flow cleanup.
+    CG->functionPassManager->add(llvm::createGVNPass());
+    CG->functionPassManager->add(llvm::createCFGSimplificationPass());
+  }
+
+  CG->functionPassManager->doInitialization();
+}
+
+
+static bool InitializeJIT() {
+  // Target registration is process-wide LLVM state; sessions initializing
+  // concurrently must only run it once.
+  static std::once_flag targetsInitialized;
+
+  std::call_once(targetsInitialized, [] {
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+    llvm::InitializeNativeTargetAsmParser();
+  });
+
+  auto JIT =
+      llvm::orc::LLJITBuilder()
+          .setCompileFunctionCreator(
+              [](llvm::orc::JITTargetMachineBuilder JTMB)
+                  -> llvm::Expected<
+                      std::unique_ptr<llvm::orc::IRCompileLayer::IRCompiler>> {
+                // Same compiler LLJIT would build itself, just pointed at the
+                // object cache.
+                return std::make_unique<llvm::orc::ConcurrentIRCompiler>(
+                    std::move(JTMB), &S->objectCache);
+              })
+          .create();
+
+  if (!JIT) {
+    llvm::logAllUnhandledErrors(JIT.takeError(), llvm::errs(), "[LogError]: ");
+
+    return false;
+  }
+
+  S->theJIT = std::move(*JIT);
+
+  // Let externs resolve against symbols already present in this process
+  // (libm and friends).
+  auto Generator =
+      llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+          S->theJIT->getDataLayout().getGlobalPrefix());
+
+  if (!Generator) {
+    llvm::logAllUnhandledErrors(Generator.takeError(), llvm::errs(),
+                                "[LogError]: ");
+
+    return false;
+  }
+
+  S->theJIT->getMainJITDylib().addGenerator(std::move(*Generator));
+
+  return true;
+}
+
+//----------------------------------------------------------------------------//
+//                                 Emission
+//----------------------------------------------------------------------------//
+
+// EmitObjectFile - Lower the populated module through the native target
+// machine and write a relocatable object, so downstream runs can link the
+// result instead of re-lexing, re-parsing, and re-codegenning the source.
+// RunWholeModuleOptimizations - Cross-function optimization over the fully
+// populated module before AOT emission. The per-function pipeline cannot
+// inline one Kaleidoscope helper into another, so small helpers called from
+// hot loops stay calls when JITing; here the standard module pipeline at the
+// session's OptLevel -- inliner, GVN, DCE and friends -- runs once over the
+// whole program and the inlined result is re-optimized. Meaningful only in
+// batch emission mode, where KeepModuleForEmission kept every definition in
+// the live module; a no-op below -O2.
+static void RunWholeModuleOptimizations() {
+  if (S->OptLevel < 2)
+    return;
+
+  llvm::PassManagerBuilder Builder;
+
+  Builder.OptLevel = S->OptLevel;
+  Builder.Inliner = llvm::createFunctionInliningPass(S->OptLevel, 0, false);
+
+  llvm::legacy::PassManager ModulePasses;
+
+  Builder.populateModulePassManager(ModulePasses);
+
+  ModulePasses.run(*CG->module);
+}
+
+static bool EmitObjectFile(const char *Path) {
+  std::string TargetTriple = llvm::sys::getDefaultTargetTriple();
+
+  std::string Error;
+
+  const llvm::Target *Target =
+      llvm::TargetRegistry::lookupTarget(TargetTriple, Error);
+
+  if (!Target) {
+    fprintf(stderr, "[LogError]: %s\n", Error.c_str());
+
+    return false;
+  }
+
+  llvm::TargetOptions Options;
+
+  std::unique_ptr<llvm::TargetMachine> TargetMachine(
+      Target->createTargetMachine(TargetTriple, "generic", "", Options,
+                                  llvm::Optional<llvm::Reloc::Model>()));
+
+  CG->module->setTargetTriple(TargetTriple);
+  CG->module->setDataLayout(TargetMachine->createDataLayout());
+
+  std::error_code EC;
+  llvm::raw_fd_ostream Out(Path, EC, llvm::sys::fs::OF_None);
+
+  if (EC) {
+    fprintf(stderr, "[LogError]: could not open '%s': %s\n", Path,
+            EC.message().c_str());
+
+    return false;
+  }
+
+  llvm::legacy::PassManager EmitPasses;
+
+  if (TargetMachine->addPassesToEmitFile(EmitPasses, Out, nullptr,
+                                         llvm::CGFT_ObjectFile)) {
+    fprintf(stderr, "[LogError]: target cannot emit object files.\n");
+
+    return false;
+  }
+
+  EmitPasses.run(*CG->module);
+
+  Out.flush();
+
+  return true;
+}
+
+// EmitBitcodeFile - Serialize the module as bitcode for caching or later
+// recompilation.
+static bool EmitBitcodeFile(const char *Path) {
+  std::error_code EC;
+  llvm::raw_fd_ostream Out(Path, EC, llvm::sys::fs::OF_None);
+
+  if (EC) {
+    fprintf(stderr, "[LogError]: could not open '%s': %s\n", Path,
+            EC.message().c_str());
+
+    return false;
+  }
+
+  llvm::WriteBitcodeToFile(*CG->module, Out);
+
+  return true;
+}
+
+//----------------------------------------------------------------------------//
+//                            Main driver code.
+//----------------------------------------------------------------------------//
+
+
+
+//----------------------------------------------------------------------------//
+//                        Incremental recompilation
+//----------------------------------------------------------------------------//
+
+// -incremental batch mode keeps one cached object file per definition in the
+// -cache-dir directory plus a manifest of source hashes from the previous
+// run. A definition whose hash is unchanged (and whose callees are all
+// unchanged) is loaded straight from its object file; only edited
+// definitions and their dependents go through codegen and the backend, so
+// rebuild time scales with the size of the edit rather than the file.
+
+// FNV-1a, used for the manifest hashes because they must be stable across
+// processes (llvm::hash_value makes no such promise).
+static const uint64_t FNVSeed = 14695981039346656037ULL;
+
+static uint64_t HashBytes(const void *Data, size_t Len, uint64_t H) {
+  const unsigned char *P = (const unsigned char *)Data;
+
+  for (size_t i = 0; i != Len; ++i) {
+    H ^= P[i];
+    H *= 1099511628211ULL;
+  }
+
+  return H;
+}
+
+static uint64_t HashByte(unsigned char Byte, uint64_t H) {
+  return HashBytes(&Byte, 1, H);
+}
+
+// HashSymbol - Hash the spelling rather than the session-local interned ID,
+// so values survive into the next run's manifest. The terminator goes in too
+// as a separator.
+static uint64_t HashSymbol(unsigned Sym, uint64_t H) {
+  const std::string &Spelling = S->symbolTable.spelling(Sym);
+
+  return HashBytes(Spelling.data(), Spelling.size() + 1, H);
+}
+
+// HashExpr - Fold one expression tree into H: the kind tag plus each node's
+// payload, spellings for anything interned. Callees collects every function
+// the tree references (plain calls and user-defined operators) for dirtiness
+// propagation along the call graph.
+static uint64_t HashExpr(const ExprAST *E, uint64_t H,
+                         std::vector<unsigned> &Callees) {
+  H = HashByte((unsigned char)E->getKind(), H);
+
+  switch (E->getKind()) {
+  case Expr_Number: {
+    double Val = static_cast<const NumberExprAST *>(E)->getVal();
+
+    return HashBytes(&Val, sizeof(Val), H);
+  }
+  case Expr_Variable:
+    return HashSymbol(static_cast<const VariableExprAST *>(E)->getName(), H);
+  case Expr_Binary: {
+    auto *Bin = static_cast<const BinaryExprAST *>(E);
+
+    H = HashByte((unsigned char)Bin->Op, H);
+
+    if (Bin->FnName)
+      Callees.push_back(Bin->FnName);
+
+    H = HashExpr(Bin->LHS, H, Callees);
+
+    return HashExpr(Bin->RHS, H, Callees);
+  }
+  case Expr_Unary: {
+    auto *Un = static_cast<const UnaryExprAST *>(E);
+
+    H = HashByte((unsigned char)Un->Opcode, H);
+
+    Callees.push_back(Un->FnName);
+
+    return HashExpr(Un->Operand, H, Callees);
+  }
+  case Expr_Call: {
+    auto *Call = static_cast<const CallExprAST *>(E);
+
+    H = HashSymbol(Call->Calle, H);
+    H = HashByte((unsigned char)Call->Args.size(), H);
+
+    Callees.push_back(Call->Calle);
+
+    for (const ExprAST *Arg : Call->Args)
+      H = HashExpr(Arg, H, Callees);
+
+    return H;
+  }
+  case Expr_If: {
+    auto *If = static_cast<const IfExprAST *>(E);
+
+    H = HashExpr(If->Cond, H, Callees);
+    H = HashExpr(If->Then, H, Callees);
+
+    return HashExpr(If->Else, H, Callees);
+  }
+  case Expr_For: {
+    auto *For = static_cast<const ForExprAST *>(E);
+
+    H = HashSymbol(For->VarName, H);
+    H = HashExpr(For->Start, H, Callees);
+    H = HashExpr(For->End, H, Callees);
+
+    // The step is optional; tag its presence so 'step 1' and no step stay
+    // distinguishable.
+    H = HashByte(For->Step != nullptr, H);
+
+    if (For->Step)
+      H = HashExpr(For->Step, H, Callees);
+
+    return HashExpr(For->Body, H, Callees);
+  }
+  case Expr_Var: {
+    auto *Var = static_cast<const VarExprAST *>(E);
+
+    for (const auto &VarInit : Var->VarNames) {
+      H = HashSymbol(VarInit.first, H);
+      H = HashByte(VarInit.second != nullptr, H);
+
+      if (VarInit.second)
+        H = HashExpr(VarInit.second, H, Callees);
+    }
+
+    return HashExpr(Var->Body, H, Callees);
+  }
+  }
+
+  return H;
+}
+
+// HashFunction - Stable hash of one whole definition: prototype name and
+// parameter spellings plus the body tree, with the session's OptLevel folded
+// in so objects compiled at a different -O level are never reused, and each
+// callee's registered arity folded in so the hash covers what the call sites
+// were actually lowered against.
+static uint64_t HashFunction(const FunctionAST &Fn,
+                             std::vector<unsigned> &Callees) {
+  uint64_t H = HashByte((unsigned char)S->OptLevel, FNVSeed);
+
+  H = HashSymbol(Fn.Proto->getNameID(), H);
+  H = HashByte((unsigned char)Fn.Proto->getArgs().size(), H);
+
+  for (unsigned Arg : Fn.Proto->getArgs())
+    H = HashSymbol(Arg, H);
+
+  H = HashExpr(Fn.Body, H, Callees);
+
+  // A call site's shape comes from the callee's prototype, not just the
+  // spelling at the call, so a caller's object is only reusable while every
+  // callee still takes the arguments it was compiled against. The Dirty set
+  // alone misses this when the edited declaration precedes the caller only
+  // in the previous run's file order -- an extern changing arity must dirty
+  // its cached callers directly. Forward references hash as not-registered
+  // and settle once the declaration has been seen.
+  for (unsigned Callee : Callees) {
+    auto It = S->functionProtos.find(Callee);
+
+    H = HashByte(It != S->functionProtos.end()
+                     ? (unsigned char)It->second.getArgs().size()
+                     : 255,
+                 H);
+  }
+
+  return H;
+}
+
+// The manifest is one "<hex hash> <name>" line per definition, stored next
+// to the cached objects.
+static std::string ManifestPath() {
+  return S->objectCache.cacheDir() + "/incremental.manifest";
+}
+
+static void ReadManifest(std::map<std::string, uint64_t> &Previous) {
+  FILE *File = fopen(ManifestPath().c_str(), "r");
+
+  if (!File)
+    return;
+
+  unsigned long long Hash;
+
+  char Name[256];
+
+  while (fscanf(File, "%llx %255s", &Hash, Name) == 2)
+    Previous[Name] = Hash;
+
+  fclose(File);
+}
+
+static void WriteManifest(const std::map<std::string, uint64_t> &Current) {
+  FILE *File = fopen(ManifestPath().c_str(), "w");
+
+  if (!File) {
+    fprintf(stderr, "[LogError]: could not write '%s'.\n",
+            ManifestPath().c_str());
+
+    return;
+  }
+
+  for (const auto &Entry : Current)
+    fprintf(File, "%016llx %s\n", (unsigned long long)Entry.second,
+            Entry.first.c_str());
+
+  fclose(File);
+}
+
+// IncrementalObjectPath - Cached object for one definition, named by a hash
+// of the function name so operator functions like "binary|" stay
+// filesystem-safe.
+static std::string IncrementalObjectPath(const std::string &Name) {
+  char Hex[32];
+
+  snprintf(Hex, sizeof(Hex), "%016llx",
+           (unsigned long long)HashBytes(Name.data(), Name.size(), FNVSeed));
+
+  return S->objectCache.cacheDir() + "/inc-" + Hex + ".o";
+}
+
+// CompileIncremental - Drive the opened file like MainLoop, but give every
+// definition its own module and object file. Unchanged definitions (per the
+// manifest) whose callees are also unchanged skip codegen and the backend
+// entirely: their cached object is added to the JIT as-is. Changed ones are
+// compiled with llvm::orc::SimpleCompiler -- the same mechanism the JIT's
+// own compile layer uses -- so the persisted object is exactly what would
+// have run, then cached for the next run. Dependents recompile because their
+// call sites were lowered against the callee's prototype. Externs and
+// top-level expressions behave as in a plain batch run; expressions evaluate
+// every time.
+static bool CompileIncremental() {
+  llvm::sys::fs::create_directories(S->objectCache.cacheDir());
+
+  std::map<std::string, uint64_t> Previous;
+
+  ReadManifest(Previous);
+
+  std::map<std::string, uint64_t> Current;
+
+  // Interned IDs of definitions recompiled this run; callers seeing one of
+  // their callees here recompile too.
+  std::set<unsigned> Dirty;
+
+  size_t NumReused = 0, NumRecompiled = 0;
+
+  auto TMOrErr =
+      llvm::orc::JITTargetMachineBuilder(S->theJIT->getTargetTriple())
+          .createTargetMachine();
+
+  if (!TMOrErr) {
+    fprintf(stderr, "[LogError]: %s\n",
+            llvm::toString(TMOrErr.takeError()).c_str());
+
+    return false;
+  }
+
+  std::unique_ptr<llvm::TargetMachine> TM = std::move(*TMOrErr);
+
+  llvm::orc::SimpleCompiler CompileModule(*TM);
+
+  while (1) {
+    switch (S->CurTok) {
+    case tok_eof:
+      WriteManifest(Current);
+
+      if (S->ShowStats)
+        fprintf(stderr, "incremental: %zu reused, %zu recompiled\n",
+                NumReused, NumRecompiled);
+
+      return true;
+    case ';':
+      getNextToken();
+      break;
+    case tok_extern:
+      HandleExtern();
+      break;
+    case tok_def: {
+      std::unique_ptr<FunctionAST> FnAST;
+
+      {
+        llvm::TimeRegion PT(S->ShowStats ? &S->parseTimer : nullptr);
+
+        FnAST = ParseDefinition();
+      }
+
+      if (!FnAST) {
+        getNextToken();
+
+        break;
+      }
+
+      RegisterPrototype(FnAST->getProto());
+
+      std::vector<unsigned> Callees;
+
+      uint64_t Hash = HashFunction(*FnAST, Callees);
+
+      unsigned NameID = FnAST->getProto().getNameID();
+
+      std::string Name = FnAST->getProto().getName();
+      std::string ObjPath = IncrementalObjectPath(Name);
+
+      bool CalleeDirty = false;
+
+      for (unsigned Callee : Callees)
+        if (Callee != NameID && Dirty.count(Callee))
+          CalleeDirty = true;
+
+      std::unique_ptr<llvm::MemoryBuffer> Obj;
+
+      auto It = Previous.find(Name);
+
+      if (!CalleeDirty && It != Previous.end() && It->second == Hash) {
+        // A missing or unreadable object simply falls through to a
+        // recompile.
+        auto BufOrErr = llvm::MemoryBuffer::getFile(ObjPath);
+
+        if (BufOrErr)
+          Obj = std::move(*BufOrErr);
+      }
+
+      if (Obj) {
+        ++NumReused;
+      } else {
+        Dirty.insert(NameID);
+
+        llvm::Function *FnIR;
+
+        {
+          llvm::TimeRegion CT(S->ShowStats ? &S->codegenTimer : nullptr);
+
+          FnIR = FnAST->codegen();
+        }
+
+        // The error is already logged and the bad body erased; no manifest
+        // entry is written, so the next run retries this definition.
+        if (!FnIR)
+          break;
+
+        {
+          llvm::TimeRegion JT(S->ShowStats ? &S->jitTimer : nullptr);
+
+          auto ObjOrErr = CompileModule(*CG->module);
+
+          if (!ObjOrErr) {
+            fprintf(stderr, "[LogError]: %s\n",
+                    llvm::toString(ObjOrErr.takeError()).c_str());
+
+            return false;
+          }
+
+          Obj = std::move(*ObjOrErr);
+        }
+
+        {
+          std::error_code EC;
+          llvm::raw_fd_ostream Out(ObjPath, EC, llvm::sys::fs::OF_None);
+
+          if (EC) {
+            fprintf(stderr, "[LogError]: could not open '%s': %s\n",
+                    ObjPath.c_str(), EC.message().c_str());
+
+            return false;
+          }
+
+          Out << Obj->getBuffer();
+        }
+
+        // The definition must not stay in the live module, or the next
+        // evaluation would move a second copy of the symbol into the JIT.
+        // The module has to go before InitializeModule() replaces the
+        // context it lives in.
+        CG->module.reset();
+
+        InitializeModule();
+
+        ++NumRecompiled;
+      }
+
+      {
+        llvm::TimeRegion JT(S->ShowStats ? &S->jitTimer : nullptr);
+
+        if (llvm::Error Err = S->theJIT->addObjectFile(std::move(Obj))) {
+          fprintf(stderr, "[LogError]: %s\n",
+                  llvm::toString(std::move(Err)).c_str());
+
+          return false;
+        }
+      }
+
+      Current[Name] = Hash;
+
+      break;
+    }
+    default:
+      HandleTopLevelExpression();
+      break;
+    }
+
+    S->astArena.Reset();
+  }
+}
+
+// CompileParallel - Parse the whole input up front, then codegen the
+// definitions on NumCodegenThreads workers. Every worker gets its own
+// LLVMContext/Module/IRBuilder (the thread_local codegen state above) and
+// pre-declares every known prototype, so cross-shard calls lower to extern
+// declarations that resolve when the shards are linked back into the main
+// thread's module. The AST is built once and only read by the workers.
+static bool CompileParallel(int NumThreads) {
+  std::vector<std::unique_ptr<FunctionAST>> Definitions;
+  std::vector<std::unique_ptr<PrototypeAST>> Externs;
+
+  while (S->CurTok != tok_eof) {
+    switch (S->CurTok) {
+    case ';':
+      getNextToken();
+      break;
+    case tok_def:
+      if (auto FnAST = ParseDefinition())
+        Definitions.push_back(std::move(FnAST));
+      else
+        getNextToken();
+      break;
+    case tok_extern:
+      if (auto ProtoAST = ParseExtern())
+        Externs.push_back(std::move(ProtoAST));
+      else
+        getNextToken();
+      break;
+    default:
+      // Parallel mode exists to produce objects; there is no JIT session to
+      // evaluate an expression in. Parse it to keep the stream consistent,
+      // then drop it.
+      LogError("top-level expressions are ignored in parallel codegen mode.");
+
+      ParseTopLevelExpr();
+      break;
+    }
+  }
+
+  size_t NumWorkers = std::min((size_t)NumThreads, Definitions.size());
+
+  if (NumWorkers == 0)
+    NumWorkers = 1;
+
+  std::vector<llvm::SmallString<0>> ShardBitcode(NumWorkers);
+  std::vector<std::thread> Workers;
+
+  CompilerState *SessionState = S;
+
+  for (size_t W = 0; W < NumWorkers; ++W) {
+    Workers.emplace_back([&, W, SessionState] {
+      // Bind the session on this thread with worker-private codegen state.
+      S = SessionState;
+
+      CodegenState WorkerCG;
+
+      CG = &WorkerCG;
+
+      InitializeModule();
+
+      for (auto &ProtoAST : Externs)
+        ProtoAST->codegen();
+
+      for (auto &FnAST : Definitions)
+        FnAST->getProto().codegen();
+
+      for (size_t i = W; i < Definitions.size(); i += NumWorkers)
+        Definitions[i]->codegen();
+
+      llvm::raw_svector_ostream BCStream(ShardBitcode[W]);
+
+      llvm::WriteBitcodeToFile(*CG->module, BCStream);
+    });
+  }
+
+  for (auto &Worker : Workers)
+    Worker.join();
+
+  // Link the shards back into the main thread's (empty) module; bodies are
+  // defined in exactly one shard each, declarations merge.
+  for (auto &Bitcode : ShardBitcode) {
+    auto Shard = llvm::parseBitcodeFile(
+        llvm::MemoryBufferRef(Bitcode.str(), "shard"), *CG->llvmContext);
+
+    if (!Shard) {
+      llvm::logAllUnhandledErrors(Shard.takeError(), llvm::errs(),
+                                  "[LogError]: ");
+
+      return false;
+    }
+
+    if (llvm::Linker::linkModules(*CG->module, std::move(*Shard))) {
+      fprintf(stderr, "[LogError]: failed to link codegen shards.\n");
+
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static void MainLoop() {
+  while (1) {
+    if (!InputIsFile())
+      fprintf(stderr, "ready> ");
+
+    switch (S->CurTok) {
+    case tok_eof:
+      return;
+    case ';':
+      getNextToken();
+      break;
+    case tok_def:
+      HandleDefinition();
+      break;
+    case tok_extern:
+      HandleExtern();
+      break;
+    default:
+      HandleTopLevelExpression();
+      break;
+    }
+
+    // The tree for this top-level unit has been codegenned (or abandoned on a
+    // parse error); drop all of its nodes at once. In lazy mode pending
+    // definitions keep living in the arena until they materialize, so the
+    // whole arena is held for the session and released at exit.
+    if (!S->LazyCodegen)
+      S->astArena.Reset();
+  }
+}
+
+//----------------------------------------------------------------------------//
+//                           Embedding interface
+//----------------------------------------------------------------------------//
+
+namespace kaleidoscope {
+
+struct Session::Impl {
+  CompilerState State;
+};
+
+Session::Session(const Options &Opts) : State(new Impl) {
+  CompilerState &CS = State->State;
+
+  CS.OptLevel = Opts.OptLevel;
+  CS.LazyCodegen = Opts.LazyCodegen;
+  CS.EmitIR = Opts.EmitIR;
+  CS.ShowStats = Opts.ShowStats;
+  CS.KeepModuleForEmission = Opts.KeepModuleForEmission;
+  CS.PrintResults = Opts.PrintResults;
+
+  if (!Opts.CacheDir.empty())
+    CS.objectCache.setCacheDir(Opts.CacheDir);
+}
+
+Session::~Session() {
+  BindSession Bind(State->State);
+
+  CloseInputFile();
+}
+
+bool Session::initialize() {
+  BindSession Bind(State->State);
+
+  if (!InitializeJIT())
+    return false;
+
+  InitializeModule();
+
+  return true;
+}
+
+bool Session::openFile(const char *Path) {
+  BindSession Bind(State->State);
+
+  return OpenInputFile(Path);
+}
+
+bool Session::inputIsFile() const {
+  return State->State.InputCursor != nullptr;
+}
+
+void Session::runInput() {
+  BindSession Bind(State->State);
+
+  if (!InputIsFile())
+    fprintf(stderr, "ready> ");
+
+  getNextToken();
+
+  MainLoop();
+}
+
+// runProtocol - Machine-facing REPL over stdin/stdout. Each request is a
+// uint32 byte count in native byte order followed by that many bytes of
+// source; each response is a uint32 payload length, then a status byte (1
+// when a top-level expression produced a value) and the value as a double.
+// No prompts and no IR dumps reach the pipe, and output is buffered and
+// flushed once per request, so an orchestrator can pipeline requests through
+// one long-lived process without text scraping. Diagnostics still go to
+// stderr. Returns when stdin closes.
+void Session::runProtocol() {
+  BindSession Bind(State->State);
+
+  std::vector<char> Request;
+
+  uint32_t RequestLen;
+
+  while (fread(&RequestLen, sizeof(RequestLen), 1, stdin) == 1) {
+    Request.resize(RequestLen);
+
+    if (RequestLen && fread(Request.data(), 1, RequestLen, stdin) != RequestLen)
+      break;
+
+    S->HaveValue = false;
+
+    // An empty request is valid framing but has nothing to lex; pointing the
+    // lexer at the null data() of an empty vector would drop it back to
+    // reading stdin and eat the following frames as source text.
+    if (RequestLen) {
+      ResetLexer(Request.data(), Request.data() + RequestLen);
+
+      getNextToken();
+
+      MainLoop();
+    }
+
+    unsigned char Status = S->HaveValue ? 1 : 0;
+
+    double Value = S->HaveValue ? S->LastValue : 0;
+
+    uint32_t PayloadLen = sizeof(Status) + sizeof(Value);
+
+    fwrite(&PayloadLen, sizeof(PayloadLen), 1, stdout);
+    fwrite(&Status, sizeof(Status), 1, stdout);
+    fwrite(&Value, sizeof(Value), 1, stdout);
+
+    fflush(stdout);
+  }
+}
+
+bool Session::compileIncremental() {
+  BindSession Bind(State->State);
+
+  getNextToken();
+
+  return CompileIncremental();
+}
+
+bool Session::compileParallel(int NumThreads) {
+  BindSession Bind(State->State);
+
+  getNextToken();
+
+  return CompileParallel(NumThreads);
+}
+
+bool Session::eval(const char *Source, size_t Size, double *Result) {
+  BindSession Bind(State->State);
+
+  ResetLexer(Source, Source + Size);
+
+  S->HaveValue = false;
+
+  getNextToken();
+
+  MainLoop();
+
+  if (Result && S->HaveValue)
+    *Result = S->LastValue;
+
+  return S->HaveValue;
+}
+
+// optimizeForEmission - See RunWholeModuleOptimizations(); call once before
+// emitObject()/emitBitcode().
+void Session::optimizeForEmission() {
+  BindSession Bind(State->State);
+
+  RunWholeModuleOptimizations();
+}
+
+void Session::printIR() {
+  BindSession Bind(State->State);
+
+  if (CG->module)
+    CG->module->print(llvm::errs(), nullptr);
+}
+
+bool Session::emitObject(const char *Path) {
+  BindSession Bind(State->State);
+
+  return EmitObjectFile(Path);
+}
+
+bool Session::emitBitcode(const char *Path) {
+  BindSession Bind(State->State);
+
+  return EmitBitcodeFile(Path);
+}
+
+void Session::dumpStats() {
+  BindSession Bind(State->State);
+
+  DumpStats();
+}
+
+} // namespace kaleidoscope
@@ -0,0 +1,118 @@
+// language.h - Public embedding interface for the Kaleidoscope compiler. A
+// host process keeps one warm Session per compilation context and feeds it
+// source through openFile()/runInput() or eval(); all compiler state lives
+// inside the Session, so several sessions can coexist in one process and
+// snippets compile in-process instead of through a spawned compiler.
+
+#ifndef KALEIDOSCOPE_LANGUAGE_H
+#define KALEIDOSCOPE_LANGUAGE_H
+
+#include <cstddef>
+#include <memory>
+#include <string>
+
+namespace kaleidoscope {
+
+// Options - Session configuration, fixed at construction. The defaults match
+// the command-line driver's defaults.
+struct Options {
+  // Per-function optimization level for JITed code; 0 disables the pipeline.
+  int OptLevel = 2;
+
+  // Defer codegen of definitions until their first use.
+  bool LazyCodegen = false;
+
+  // Dump IR for batch compiles too, not just interactive sessions.
+  bool EmitIR = false;
+
+  // Collect the phase timers and counters reported by dumpStats().
+  bool ShowStats = false;
+
+  // Keep every definition in the live module so emitObject()/emitBitcode()
+  // see the whole program; evaluation then clones modules for the JIT
+  // instead of handing them over.
+  bool KeepModuleForEmission = false;
+
+  // Echo "Evaluated to" lines for top-level expressions, as the interactive
+  // driver does; embedders normally read results from eval() instead.
+  bool PrintResults = false;
+
+  // Directory for the on-disk object cache; empty disables caching.
+  std::string CacheDir;
+};
+
+// Session - One warm compiler instance: the JIT, interned symbols, and every
+// definition seen so far. Construct, initialize(), then compile and evaluate
+// any number of snippets; definitions persist across calls. A Session may be
+// used from one thread at a time, but distinct Sessions share nothing and
+// can compile concurrently on different threads.
+class Session {
+public:
+  explicit Session(const Options &Opts = Options());
+  ~Session();
+
+  Session(const Session &) = delete;
+  Session &operator=(const Session &) = delete;
+
+  // initialize - Bring up the JIT and the first module. Must succeed before
+  // any other call below.
+  bool initialize();
+
+  // openFile - Map Path as the session's input for runInput() or
+  // compileParallel().
+  bool openFile(const char *Path);
+
+  // inputIsFile - Whether input comes from a buffer rather than stdin.
+  bool inputIsFile() const;
+
+  // runInput - Parse and evaluate the whole input: the opened file, or an
+  // interactive stdin loop when no file was opened.
+  void runInput();
+
+  // runProtocol - Serve length-prefixed requests from stdin until it closes:
+  // uint32 byte count then that many bytes of source in, and per request one
+  // binary result frame out (uint32 payload length, status byte, double
+  // value), flushed once per request. For driving the session over pipes
+  // without prompts or text scraping; diagnostics still go to stderr.
+  void runProtocol();
+
+  // compileParallel - Batch-compile the opened file with NumThreads codegen
+  // workers.
+  bool compileParallel(int NumThreads);
+
+  // compileIncremental - Batch-compile the opened file, reusing per-function
+  // object code from CacheDir for definitions unchanged since the previous
+  // run (per a persisted manifest); only edited definitions and their
+  // dependents recompile. Requires a non-empty CacheDir.
+  bool compileIncremental();
+
+  // eval - Compile and run Size bytes of Kaleidoscope source (definitions,
+  // externs, and expressions). Returns true and stores the last top-level
+  // expression's value through Result when one evaluated.
+  bool eval(const char *Source, size_t Size, double *Result = nullptr);
+
+  // printIR - Dump the live module's IR to stderr.
+  void printIR();
+
+  // optimizeForEmission - Run the whole-module pipeline (inliner, GVN, DCE)
+  // over the live module at OptLevel 2 and up; a no-op below that. Call once
+  // before emitting in batch mode.
+  void optimizeForEmission();
+
+  // emitObject / emitBitcode - Write the live module to Path.
+  bool emitObject(const char *Path);
+  bool emitBitcode(const char *Path);
+
+  // dumpStats - Print the counters and phase timers collected under
+  // ShowStats.
+  void dumpStats();
+
+private:
+  struct Impl;
+
+  std::unique_ptr<Impl> State;
+};
+
+} // namespace kaleidoscope
+
+#endif // KALEIDOSCOPE_LANGUAGE_H
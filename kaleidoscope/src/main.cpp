@@ -1,590 +1,123 @@
-#include <llvm/ADT/APFloat.h>
-#include <llvm/ADT/STLExtras.h>
-#include <llvm/IR/BasicBlock.h>
-#include <llvm/IR/Constants.h>
-#include <llvm/IR/DerivedTypes.h>
-#include <llvm/IR/Function.h>
-#include <llvm/IR/IRBuilder.h>
-#include <llvm/IR/LLVMContext.h>
-#include <llvm/IR/Module.h>
-#include <llvm/IR/Type.h>
-#include <llvm/IR/Verifier.h>
+// main.cpp - Command-line driver. All compiler work happens in the
+// libkaleidoscope library (language.h); this translation unit only parses
+// arguments and strings the session calls together.
+
+#include "language.h"
 
-#include <algorithm>
 #include <cctype>
 #include <cstdio>
 #include <cstdlib>
-#include <map>
-#include <memory>
-#include <string>
-#include <utility>
-#include <vector>
-
-enum Token {
-  tok_eof = -1,
-
-  tok_def = -2,
-  tok_extern = -3,
-
-  tok_identifier = -4,
-  tok_number = -5
-};
-
-static std::string IdentifierStr;
-static double NumVal;
-
-static int gettok() {
-  static int LastChar = ' ';
-
-  // Whitespace
-  while (isspace(LastChar))
-    LastChar = getchar();
-
-  // Identifier: [a-zA-z][a-zA-Z0-9]*
-  if (isalpha(LastChar)) {
-    IdentifierStr = LastChar;
-
-    while (isalnum((LastChar = getchar())))
-      IdentifierStr += LastChar;
-
-    if (IdentifierStr == "def")
-      return tok_def;
-
-    if (IdentifierStr == "extern")
-      return tok_extern;
-
-    return tok_identifier;
-  }
-
-  // Number: [0-9.]+
-  if (isdigit(LastChar) || LastChar == '.') {
-    std::string NumStr;
-
-    do {
-      NumStr += LastChar;
-      LastChar = getchar();
-    } while (isdigit(LastChar) || LastChar == '.');
-
-    NumVal = strtod(NumStr.c_str(), 0);
-
-    return tok_number;
-  }
-
-  // Handle comments.
-  if (LastChar == '#') {
-    do
-      LastChar = getchar();
-    while (LastChar != EOF && LastChar != '\n' && LastChar != '\r');
-
-    if (LastChar != EOF)
-      return gettok();
-  }
-
-  // Check for end of file.
-  if (LastChar == EOF)
-    return tok_eof;
-
-  int ThisChar = LastChar;
-
-  LastChar = getchar();
-
-  return ThisChar;
-}
-
-// ExprAst - Base class for all expression nodes.
-class ExprAST {
-public:
-  virtual ~ExprAST() {}
-  virtual llvm::Value *codegen() = 0;
-};
-
-// NumberExprAST - Expression class for numbers.
-class NumberExprAST : public ExprAST {
-  double Val;
-
-public:
-  NumberExprAST(double Val) : Val(Val) {}
-  virtual llvm::Value *codegen();
-};
-
-// VariableExprAST - Expression class for variables.
-class VariableExprAST : public ExprAST {
-  std::string Name;
-
-public:
-  VariableExprAST(const std::string &Name) : Name(Name) {}
-  virtual llvm::Value *codegen();
-};
-
-// BinaryExprAST - Expression class for binary operators.
-class BinaryExprAST : public ExprAST {
-  char Op;
-  std::unique_ptr<ExprAST> LHS, RHS;
-
-public:
-  BinaryExprAST(char op, std::unique_ptr<ExprAST> LHS,
-                std::unique_ptr<ExprAST> RHS)
-      : Op(op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
-  virtual llvm::Value *codegen();
-};
-
-// CallExprAST - Expression class for functions calls.
-class CallExprAST : public ExprAST {
-  std::string Calle;
-  std::vector<std::unique_ptr<ExprAST>> Args;
-
-public:
-  CallExprAST(const std::string &Calle,
-              std::vector<std::unique_ptr<ExprAST>> Args)
-      : Calle(Calle), Args(std::move(Args)) {}
-  virtual llvm::Value *codegen();
-};
-
-class PrototypeAST {
-  std::string Name;
-  std::vector<std::string> Args;
-
-public:
-  PrototypeAST(const std::string &Name, std::vector<std::string> Args)
-      : Name(Name), Args(std::move(Args)) {}
-
-  const std::string &getName() const { return Name; }
-
-  virtual llvm::Function *codegen();
-};
-
-class FunctionAST {
-  std::unique_ptr<PrototypeAST> Proto;
-  std::unique_ptr<ExprAST> Body;
-
-public:
-  FunctionAST(std::unique_ptr<PrototypeAST> Proto,
-              std::unique_ptr<ExprAST> Body)
-      : Proto(std::move(Proto)), Body(std::move(Body)) {}
-
-    virtual llvm::Function *codegen();
-};
-
-//----------------------------------------------------------------------------//
-//                                 Parser
-//----------------------------------------------------------------------------//
-
-static int CurTok;
-
-static int getNextToken() { return CurTok = gettok(); }
-
-static std::map<char, int> BinopPrecedence;
-
-static int GetTokPrecedence() {
-  if (!isascii(CurTok))
-    return -1;
-
-  int TokPrec = BinopPrecedence[CurTok];
-
-  if (TokPrec <= 0)
-    return -1;
+#include <cstring>
 
-  return TokPrec;
-}
-
-std::unique_ptr<ExprAST> LogError(const char *Str) {
-  fprintf(stderr, "[LogError]: %s\n", Str);
-
-  return nullptr;
-}
-
-std::unique_ptr<PrototypeAST> LogErrorP(const char *Str) {
-  LogError(Str);
-
-  return nullptr;
-}
-
-static std::unique_ptr<ExprAST> ParseExpression();
-
-static std::unique_ptr<ExprAST> ParseNumberExpr() {
-  auto Result = std::make_unique<NumberExprAST>(NumVal);
-
-  getNextToken();
-
-  return std::move(Result);
-}
-
-static std::unique_ptr<ExprAST> ParseParenExpr() {
-  getNextToken();
-
-  auto V = ParseExpression();
-
-  if (!V) {
-    return nullptr;
-  }
-
-  if (CurTok != ')') {
-    return LogError("expected ')'");
-  }
-
-  getNextToken();
-
-  return V;
-}
-
-static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
-  std::string IdName = IdentifierStr;
-
-  getNextToken();
-
-  if (CurTok != '(')
-    return std::make_unique<VariableExprAST>(IdName);
-
-  getNextToken();
-
-  std::vector<std::unique_ptr<ExprAST>> Args;
-
-  if (CurTok != ')') {
-    while (1) {
-      if (auto Arg = ParseExpression())
-        Args.push_back(std::move(Arg));
-      else
-        return nullptr;
-
-      if (CurTok == ')')
-        break;
-
-      if (CurTok != ',')
-        return LogError("Expected ')' or ',' in the argument list.");
-
-      getNextToken();
+int main(int argc, char **argv) {
+  kaleidoscope::Options Opts;
+
+  const char *InputPath = nullptr;
+  const char *ObjectPath = nullptr;
+  const char *BitcodePath = nullptr;
+
+  int NumCodegenThreads = 1;
+
+  bool ProtocolMode = false;
+  bool Incremental = false;
+
+  for (int i = 1; i < argc; ++i) {
+    const char *Arg = argv[i];
+
+    if (Arg[0] == '-' && Arg[1] == 'O' && isdigit(Arg[2])) {
+      Opts.OptLevel = Arg[2] - '0';
+    } else if (strcmp(Arg, "-emit-ir") == 0) {
+      Opts.EmitIR = true;
+    } else if (strcmp(Arg, "-lazy") == 0) {
+      Opts.LazyCodegen = true;
+    } else if (strcmp(Arg, "-stats") == 0) {
+      Opts.ShowStats = true;
+    } else if (strcmp(Arg, "-protocol") == 0) {
+      ProtocolMode = true;
+    } else if (strcmp(Arg, "-incremental") == 0) {
+      Incremental = true;
+    } else if (Arg[0] == '-' && Arg[1] == 'j' && isdigit(Arg[2])) {
+      NumCodegenThreads = atoi(Arg + 2);
+    } else if (strcmp(Arg, "-o") == 0 && i + 1 < argc) {
+      ObjectPath = argv[++i];
+    } else if (strcmp(Arg, "-emit-bc") == 0 && i + 1 < argc) {
+      BitcodePath = argv[++i];
+    } else if (strcmp(Arg, "-cache-dir") == 0 && i + 1 < argc) {
+      Opts.CacheDir = argv[++i];
+    } else if (Arg[0] == '-') {
+      fprintf(stderr, "[LogError]: unknown option '%s'\n", Arg);
+
+      return 1;
+    } else {
+      InputPath = Arg;
     }
   }
 
-  getNextToken();
-
-  return std::make_unique<CallExprAST>(IdName, std::move(Args));
-}
+  if (Incremental &&
+      (!InputPath || Opts.CacheDir.empty() || Opts.LazyCodegen ||
+       NumCodegenThreads > 1 || ObjectPath || BitcodePath || ProtocolMode)) {
+    fprintf(stderr,
+            "[LogError]: -incremental requires a source file and -cache-dir, "
+            "and is incompatible with -lazy, -j, -o, -emit-bc, and "
+            "-protocol.\n");
 
-static std::unique_ptr<ExprAST> ParsePrimary() {
-  switch (CurTok) {
-  default:
-    return LogError("Unkown token when expecting expression.");
-  case tok_identifier:
-    return ParseIdentifierExpr();
-  case tok_number:
-    return ParseNumberExpr();
-  case '(':
-    return ParseParenExpr();
+    return 1;
   }
-}
-
-static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
-                                              std::unique_ptr<ExprAST> LHS) {
-  while (1) {
-    int TokPrec = GetTokPrecedence();
-
-    if (TokPrec < ExprPrec)
-      return LHS;
 
-    int BinOp = CurTok;
+  Opts.KeepModuleForEmission = ObjectPath || BitcodePath;
 
-    getNextToken();
+  // The CLI is interactive-first and echoes evaluation results; in protocol
+  // mode results travel in the response frames instead.
+  Opts.PrintResults = !ProtocolMode;
 
-    auto RHS = ParsePrimary();
+  kaleidoscope::Session Session(Opts);
 
-    if (!RHS)
-      return nullptr;
+  if (InputPath && !Session.openFile(InputPath))
+    return 1;
 
-    int NextPrec = GetTokPrecedence();
+  if (!Session.initialize())
+    return 1;
 
-    if (TokPrec < NextPrec) {
-      RHS = ParseBinOpRHS(TokPrec + 1, std::move(RHS));
+  if (Incremental) {
+    if (!Session.compileIncremental())
+      return 1;
+  } else if (ProtocolMode) {
+    if (InputPath) {
+      fprintf(stderr, "[LogError]: -protocol reads requests from stdin.\n");
 
-      if (!RHS)
-        return nullptr;
+      return 1;
     }
 
-    LHS =
-        std::make_unique<BinaryExprAST>(BinOp, std::move(LHS), std::move(RHS));
-  }
-}
-
-static std::unique_ptr<ExprAST> ParseExpression() {
-  auto LHS = ParsePrimary();
-
-  if (!LHS)
-    return nullptr;
-
-  return ParseBinOpRHS(0, std::move(LHS));
-}
+    Session.runProtocol();
+  } else if (NumCodegenThreads > 1) {
+    if (!Session.inputIsFile()) {
+      fprintf(stderr, "[LogError]: -j requires a source file.\n");
 
-static std::unique_ptr<PrototypeAST> ParsePrototype() {
-  if (CurTok != tok_identifier)
-    return LogErrorP("Expected function in prototype.");
-
-  std::string FnName = IdentifierStr;
-
-  getNextToken();
-
-  if (CurTok != '(')
-    return LogErrorP("Expected '(' in prototype.");
-
-  std::vector<std::string> ArgNames;
-
-  while (getNextToken() == tok_identifier) {
-    ArgNames.push_back(IdentifierStr);
-  }
-
-  if (CurTok != ')')
-    return LogErrorP("Expected ')' in prototype.");
-
-  getNextToken();
-
-  return std::make_unique<PrototypeAST>(FnName, std::move(ArgNames));
-}
-
-static std::unique_ptr<FunctionAST> ParseDefinition() {
-  getNextToken();
-
-  auto Proto = ParsePrototype();
-
-  if (!Proto)
-    return nullptr;
-
-  if (auto E = ParseExpression())
-    return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
-
-  return nullptr;
-}
-
-static std::unique_ptr<FunctionAST> ParseTopLevelExpr() {
-  if (auto E = ParseExpression()) {
-    auto Proto = std::make_unique<PrototypeAST>("", std::vector<std::string>());
-
-    return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
-  }
-
-  return nullptr;
-}
-
-static std::unique_ptr<PrototypeAST> ParseExtern() {
-  getNextToken();
-
-  return ParsePrototype();
-}
-
-//----------------------------------------------------------------------------//
-//                            Top-Level parsing
-//----------------------------------------------------------------------------//
-
-static void HandleDefinition() {
-  if (auto FnAST = ParseDefinition()) {
-    if (auto *FnIR = FnAST->codegen()) {
-      fprintf(stderr, "Read function definitions:");
-
-      FnIR->print(llvm::errs());
-
-      fprintf(stderr, "\n");
-    }
-  } else {
-    getNextToken();
-  }
-}
-
-static void HandleExtern() {
-  if (auto ProtoAST = ParseExtern()) {
-    if (auto *FnIR = ProtoAST->codegen()) {
-      fprintf(stderr, "Read extern.");
-
-      FnIR->print(llvm::errs());
-
-      fprintf(stderr, "\n");
+      return 1;
     }
-  } else {
-    getNextToken();
-  }
-}
-
-static void HandleTopLevelExpression() {
-  if (auto FnAST = ParseTopLevelExpr()) {
-    if (auto *FnIR = FnAST->codegen()) {
-      fprintf(stderr, "Read top level expression.");
 
-      FnIR->print(llvm::errs());
-
-      fprintf(stderr, "\n");
-
-      FnIR->eraseFromParent();
-    }
+    if (!Session.compileParallel(NumCodegenThreads))
+      return 1;
   } else {
-    getNextToken();
-  }
-}
-
-// ---------------------------------------------------
-
-static std::unique_ptr<llvm::LLVMContext> llvmContext;
-static std::unique_ptr<llvm::IRBuilder<>> irBuilder;
-
-static std::unique_ptr<llvm::Module> module;
-static std::map<std::string, llvm::Value *> namedValues;
-
-llvm::Value *LogErrorV(const char *Str) {
-  LogError(Str);
-
-  return nullptr;
-}
-
-llvm::Value *NumberExprAST::codegen() {
-  return llvm::ConstantFP::get(*llvmContext, llvm::APFloat(Val));
-}
-
-llvm::Value *VariableExprAST::codegen() {
-  llvm::Value *V = namedValues[Name];
-
-  if (!V)
-    LogError("Unkown variable name.");
-
-  return V;
-}
-
-llvm::Value *BinaryExprAST::codegen() {
-  llvm::Value *L = LHS->codegen();
-  llvm::Value *R = LHS->codegen();
-
-  if (!L || !R)
-    return nullptr;
-
-  // TODO: Add additional binary operators.
-  switch (Op) {
-    case '+':
-      return irBuilder->CreateFAdd(L, R, "addtmp");
-    case '-':
-      return irBuilder->CreateFSub(L, R, "subtmp");
-    case '*':
-      return irBuilder->CreateFMul(L, R, "multmp");
-    case '<':
-      L = irBuilder->CreateFCmpULT(L, R, "cmptmp");
-
-      return irBuilder->CreateUIToFP(L, llvm::Type::getDoubleTy(*llvmContext));
-    default:
-      return LogErrorV("Invalid binary operator.");
-  }
-}
-
-llvm::Value *CallExprAST::codegen() {
-  llvm::Function *CalleF = module->getFunction(Calle);
-
-  if (!CalleF)
-    return LogErrorV("Unkown function refrenced.");
-
-  if (CalleF->arg_size() != Args.size())
-    return LogErrorV("Incorrect number of arguments passed.");
-  
-  std::vector<llvm::Value*> ArgsV;
-
-  for (unsigned int i = 0, e = Args.size(); i != e; ++i) {
-    ArgsV.push_back(Args[i]->codegen());
-
-    if (!Args.back())
-      return nullptr;
-  }
-
-  return irBuilder->CreateCall(CalleF, ArgsV, "calltmp");
-}
-
-llvm::Function *PrototypeAST::codegen() {
-  std::vector<llvm::Type*> Doubles(Args.size(), llvm::Type::getDoubleTy(*llvmContext));
-
-  llvm::FunctionType *functionType = llvm::FunctionType::get(llvm::Type::getDoubleTy(*llvmContext), Doubles, false);
-
-  llvm::Function *function = llvm::Function::Create(functionType, llvm::Function::ExternalLinkage, Name, module.get());
-
-  unsigned index = 0;
-
-  for (auto &Arg : function->args()) {
-    Arg.setName(Args[index++]);
-  }
-  
-  return function;
-}
-
-llvm::Function *FunctionAST::codegen() {
-  llvm::Function *function = module->getFunction(Proto->getName());
-
-  if (!function) function = Proto->codegen();
-
-  if (!function) return nullptr;
-
-  if (!function->empty()) return (llvm::Function*) LogErrorV("Function cannot be redefined.");
-
-  llvm::BasicBlock *BB = llvm::BasicBlock::Create(*llvmContext, "entry", function);
-  
-  irBuilder->SetInsertPoint(BB);
-
-  namedValues.clear();
-
-  for (auto &Arg : function->args())
-    namedValues[Arg.getName()] = &Arg;
-
-  if (llvm::Value *RetVal = Body->codegen()) {
-    irBuilder->CreateRet(RetVal);
-
-    llvm::verifyFunction(*function);
-
-    return function;
-  }
-
-  function->eraseFromParent();
-
-  return nullptr;
-}
-
-
-static void InitializeModule() {
-  llvmContext = std::make_unique<llvm::LLVMContext>();
-  module = std::make_unique<llvm::Module>("My cool Jit!", *llvmContext);
-
-  irBuilder = std::make_unique<llvm::IRBuilder<>>(*llvmContext);
-}
-
-//----------------------------------------------------------------------------//
-//                            Main driver code.
-//----------------------------------------------------------------------------//
-
-static void MainLoop() {
-  while (1) {
-    fprintf(stderr, "ready> ");
-
-    switch (CurTok) {
-    case tok_eof:
-      return;
-    case ';':
-      getNextToken();
-      break;
-    case tok_def:
-      HandleDefinition();
-      break;
-    case tok_extern:
-      HandleExtern();
-      break;
-    default:
-      HandleTopLevelExpression();
-      break;
-    }
+    Session.runInput();
   }
-}
 
-int main(int argc, char **argv) {
-  BinopPrecedence['<'] = 10;
-  BinopPrecedence['+'] = 20;
-  BinopPrecedence['-'] = 20;
-  BinopPrecedence['*'] = 40;
+  // Batch (file) compiles and protocol mode stay quiet unless IR was asked
+  // for explicitly.
+  if ((!Session.inputIsFile() && !ProtocolMode) || Opts.EmitIR)
+    Session.printIR();
 
-  fprintf(stderr, "ready> ");
-  getNextToken();
+  if (ObjectPath || BitcodePath)
+    Session.optimizeForEmission();
 
-  InitializeModule();
+  if (BitcodePath && !Session.emitBitcode(BitcodePath))
+    return 1;
 
-  MainLoop();
+  if (ObjectPath && !Session.emitObject(ObjectPath))
+    return 1;
 
-  module->print(llvm::errs(), nullptr);
+  if (Opts.ShowStats)
+    Session.dumpStats();
 
   return 0;
-}
\ No newline at end of file
+}